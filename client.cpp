@@ -4,40 +4,109 @@
  */
 
 #include "threadsafe_queue.h"
+#include "shm_transport.h"
+#include "fd_passing.h"
 #include <boost/thread.hpp>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <thread>
 #include <array>
 
 #define PORT "9000"
 
+// Host name that selects the shared memory transport to a local server.
+#define SHM_HOST "shm"
+
+// Reconnect backoff after losing the server, doubling up to the maximum.
+#define RECONNECT_MIN std::chrono::milliseconds(100)
+#define RECONNECT_MAX std::chrono::seconds(5)
+
+// How long a send over shared memory waits on a full ring.
+#define SHM_SEND_TIMEOUT std::chrono::seconds(1)
+
 using boost::asio::ip::tcp;
+namespace local = boost::asio::local;
 
 /**
- * Represents a single client on the network.
+ * Represents a single client on the network. Connecting to SHM_HOST talks
+ * to a server on the same host over shared memory instead of TCP.
+ *
+ * The server starts every connection with a "SESSION <token> <offset>" line
+ * and numbers every byte after it. If a TCP connection drops, the client
+ * reconnects with backoff and asks to resume from the last byte it got, so
+ * the server only resends what was missed.
  */
 class NetworkClient {
 public:
   NetworkClient(std::string host) :
-    socket(io_service), 
-    service_thread(boost::bind(&NetworkClient::run_service, this)) {
-    tcp::resolver resolver(io_service);
-    tcp::resolver::query query(tcp::v4(), host, PORT);      
-    tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
-    boost::asio::connect(socket, endpoint_iterator);      
+    socket(io_service), local_socket(io_service), client_wake(io_service),
+    reconnect_timer(io_service), use_shm(host == SHM_HOST), server_wake_fd(-1),
+    connected(false), awaiting_session(true), received(0), backoff(RECONNECT_MIN) {
+    if (use_shm) {
+      connect_shm();
+    } else {
+      tcp::resolver resolver(io_service);
+      tcp::resolver::query query(tcp::v4(), host, PORT);      
+      tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
+      endpoints.assign(endpoint_iterator, tcp::resolver::iterator());
+      boost::asio::connect(socket, endpoints.begin(), endpoints.end());
+      boost::asio::write(socket, boost::asio::buffer(greeting()));
+    }
+    connected = true;
+    service_thread = boost::thread(boost::bind(&NetworkClient::run_service, this));
   }
   
   // Destructor.
   ~NetworkClient() {
       io_service.stop();
       service_thread.join();
+      if (server_wake_fd >= 0)
+        close(server_wake_fd);
   }
   
-  // Synchronously sends a message to the server. 
-  void send(std::string message) {
-    boost::asio::write(socket, boost::asio::buffer(message));
+  // Synchronously sends a message to the server. Returns false if the
+  // message was dropped because the client is reconnecting, or because a
+  // shared memory server is gone or hasn't made room within
+  // SHM_SEND_TIMEOUT.
+  bool send(std::string message) {
+    if (!use_shm) {
+      std::lock_guard<std::mutex> lock(socket_mutex);
+      if (!connected)
+        return false;
+      boost::system::error_code error;
+      boost::asio::write(socket, boost::asio::buffer(message), error);
+      // A failed write shows up as a failed read too, which reconnects.
+      return !error;
+    }
+
+    if (!connected)
+      return false;
+
+    // Wait for the server to make room if the ring is full.
+    bool wake;
+    auto deadline = std::chrono::steady_clock::now() + SHM_SEND_TIMEOUT;
+    while (!region->to_server().push(message.data(), message.size(), wake)) {
+      if (message.size() > ShmRing::max_message())
+        throw std::length_error("Message too large for shared memory");
+      if (!connected || std::chrono::steady_clock::now() > deadline) {
+        std::cerr << "[send] shared memory server not reading.\n";
+        return false;
+      }
+      std::this_thread::yield();
+    }
+    if (wake)
+      shm_notify(server_wake_fd);
+    return true;
+  }
+
+  // Returns true while connected to the server.
+  bool is_connected() {
+    return connected;
   }
 
   // Returns true if there are message(s) in the queue.
@@ -53,8 +122,90 @@ public:
   }
 
 private:
+  // Creates the shared memory region and hands it to the local server,
+  // along with the eventfds each side waits on.
+  void connect_shm() {
+    local_socket.connect(local::stream_protocol::endpoint(SHM_SOCKET_PATH));
+
+    int memfd;
+    region.reset(ShmRegion::create(memfd));
+    server_wake_fd = eventfd(0, EFD_CLOEXEC);
+    int client_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (server_wake_fd < 0 || client_wake_fd < 0)
+      throw std::runtime_error("eventfd failed");
+    client_wake.assign(client_wake_fd);
+
+    int fds[3] = { memfd, server_wake_fd, client_wake_fd };
+    bool sent = send_fds(local_socket.native_handle(), fds, 3, "shm");
+    close(memfd);
+    if (!sent)
+      throw std::runtime_error("Shared memory handshake failed");
+
+    bool wake;
+    std::string hello = greeting();
+    region->to_server().push(hello.data(), hello.size(), wake);
+    shm_notify(server_wake_fd);
+
+    // Any read on the socket means the server is gone.
+    local_socket.async_read_some(boost::asio::buffer(closed_buf),
+      boost::bind(&NetworkClient::handle_shm_closed, this, boost::asio::placeholders::error));
+  }
+
+  // Callback for when the server's end of the Unix socket closes.
+  void handle_shm_closed(const boost::system::error_code& error) {
+    if (error == boost::asio::error::operation_aborted)
+      return;
+    std::cerr << "Lost shared memory server.\n";
+    connected = false;
+    client_wake.cancel();
+  }
+
+  // The first line sent on a connection: a resume request if there's a
+  // session to resume, otherwise a plain hello.
+  std::string greeting() {
+    if (session_token.empty())
+      return "HELLO\n";
+    return "RESUME " + session_token + " " + std::to_string(received) + "\n";
+  }
+
+  // Handles bytes from the server, stripping the session line at the start
+  // of each connection and counting the rest.
+  void handle_data(const char* data, std::size_t size) {
+    if (awaiting_session) {
+      session_line.append(data, size);
+      std::size_t newline = session_line.find('\n');
+      if (newline == std::string::npos)
+        return;
+
+      std::istringstream line(session_line.substr(0, newline));
+      std::string command, token;
+      uint64_t offset = 0;
+      line >> command >> token >> offset;
+      if (command != "SESSION")
+        std::cerr << "Expected session from server, got: " << session_line;
+      if (!session_token.empty() && token != session_token)
+        std::cerr << "Session could not be resumed; starting over.\n";
+      session_token = token;
+      received = offset;
+      awaiting_session = false;
+
+      std::string rest = session_line.substr(newline + 1);
+      session_line.clear();
+      if (!rest.empty())
+        handle_data(rest.data(), rest.size());
+      return;
+    }
+
+    received += size;
+    message_queue.push(std::string(data, size));
+  }
+
   // Begin receiving messages by adding an async receive task.
   void start_receive() {      
+    if (use_shm) {
+      start_receive_shm();
+      return;
+    }
     socket.async_receive(boost::asio::buffer(recv_buffer),
       boost::bind(&NetworkClient::handle_receive, this, 
         boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
@@ -62,13 +213,82 @@ private:
   
   // Callback for when receive is completed. Adds to message queue, continue reading.
   void handle_receive(const boost::system::error_code& error, std::size_t bytes_transferred) {
-    if (!error) {
-        std::string message(recv_buffer.data(), recv_buffer.data() + bytes_transferred);
-        message_queue.push(message);
+    if (error) {
+      if (error != boost::asio::error::operation_aborted)
+        connection_lost(error);
+      return;
+    }
+
+    handle_data(recv_buffer.data(), bytes_transferred);
+    start_receive();
+  }
+
+  // Closes the dead socket and schedules a reconnect.
+  void connection_lost(const boost::system::error_code& error) {
+    std::cerr << "Lost connection to server: " << error.message() << "\n";
+    {
+      std::lock_guard<std::mutex> lock(socket_mutex);
+      connected = false;
+      boost::system::error_code ignored;
+      socket.close(ignored);
+    }
+    schedule_reconnect();
+  }
+
+  // Waits out the backoff before the next reconnect attempt.
+  void schedule_reconnect() {
+    reconnect_timer.expires_from_now(backoff);
+    reconnect_timer.async_wait(boost::bind(&NetworkClient::handle_reconnect, this,
+          boost::asio::placeholders::error));
+    backoff = std::min<std::chrono::milliseconds>(backoff * 2, RECONNECT_MAX);
+  }
+
+  // Callback for when it's time to try reconnecting. Connects synchronously
+  // on a fresh socket, since there's nothing else for the service thread to
+  // do meanwhile, and only swaps it in once it's greeted the server.
+  void handle_reconnect(const boost::system::error_code& error) {
+    if (error)
+      return;
+
+    tcp::socket fresh(io_service);
+    boost::system::error_code connect_error;
+    boost::asio::connect(fresh, endpoints.begin(), endpoints.end(), connect_error);
+    if (!connect_error)
+      boost::asio::write(fresh, boost::asio::buffer(greeting()), connect_error);
+    if (connect_error) {
+      schedule_reconnect();
+      return;
     }
 
+    std::lock_guard<std::mutex> lock(socket_mutex);
+    socket = std::move(fresh);
+    std::cerr << "Reconnected to server.\n";
+    connected = true;
+    awaiting_session = true;
+    backoff = RECONNECT_MIN;
     start_receive();
   }
+
+  // Drains the shared memory ring, then waits for the server to signal more.
+  void start_receive_shm() {
+    std::string message;
+    while (region->to_client().pop(message)) {
+      handle_data(message.data(), message.size());
+    }
+
+    client_wake.async_read_some(boost::asio::buffer(&wake_buf, sizeof(wake_buf)),
+      boost::bind(&NetworkClient::handle_wake, this, boost::asio::placeholders::error));
+  }
+
+  // Callback for when the server signals new messages.
+  void handle_wake(const boost::system::error_code& error) {
+    if (error) {
+      if (error != boost::asio::error::operation_aborted)
+        std::cerr << "Shared memory wake error: " << error << "\n";
+      return;
+    }
+    start_receive_shm();
+  }
   
   // Service thread for receiving messages.
   void run_service() {
@@ -89,6 +309,27 @@ private:
   boost::asio::io_service io_service;
   tcp::socket socket;
   boost::array<char, BUFSIZ> recv_buffer;
+  local::stream_protocol::socket local_socket;
+  std::unique_ptr<ShmRegion> region;
+  boost::asio::posix::stream_descriptor client_wake;
+  std::vector<tcp::endpoint> endpoints;
+  boost::asio::steady_timer reconnect_timer;
+  bool use_shm;
+  int server_wake_fd;
+  uint64_t wake_buf;
+  char closed_buf[1];
+
+  // Guards the TCP socket, which the main thread writes to while the
+  // service thread may be reconnecting it.
+  std::mutex socket_mutex;
+  std::atomic<bool> connected;
+
+  // Session state, only touched on the service thread after construction.
+  bool awaiting_session;
+  std::string session_line;
+  std::string session_token;
+  uint64_t received;
+  std::chrono::milliseconds backoff;
   boost::thread service_thread;
   ThreadSafeQueue<std::string> message_queue;
 };
@@ -0,0 +1,384 @@
+#pragma once
+
+#include "job_system.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Entities handled per job by EntityStore::update.
+#define ENTITY_GRAIN 8192
+
+// Bytes in a fixed width entity record, see EntityStore::write_record.
+#define ENTITY_RECORD_SIZE 48
+
+/**
+ * Stable reference to an entity. Stays valid while the entity lives, even
+ * as others are created and destroyed; a stale handle is detected by its
+ * generation.
+ */
+struct EntityHandle {
+  uint32_t slot;
+  uint32_t generation;
+};
+
+/**
+ * Axis aligned box entities are kept inside.
+ */
+struct Bounds {
+  float min_x, min_y, max_x, max_y;
+};
+
+/**
+ * Game state store keeping entity components in structure of arrays
+ * layout, so the per-tick passes stream through tightly packed floats and
+ * vectorize. Entities are packed densely; handles go through a slot table,
+ * and removal swaps the last entity into the hole.
+ *
+ * Every pass that changes an entity sets its dirty flag, and
+ * collect_dirty() hands the changed entities to the broadcast path.
+ */
+class EntityStore {
+public:
+  // Adds an entity and returns its handle. New entities start dirty.
+  EntityHandle create(float x, float y, float vx, float vy) {
+    uint32_t slot;
+    if (!free_slots.empty()) {
+      slot = free_slots.back();
+      free_slots.pop_back();
+    } else {
+      slot = slots.size();
+      slots.push_back(Slot { 0, 0 });
+    }
+
+    slots[slot].dense = pos_x.size();
+    pos_x.push_back(x);
+    pos_y.push_back(y);
+    vel_x.push_back(vx);
+    vel_y.push_back(vy);
+    dirty.push_back(DIRTY);
+    ids.push_back(slot);
+    return EntityHandle { slot, slots[slot].generation };
+  }
+
+  // Removes an entity. Its id is reported by collect_removed().
+  void destroy(EntityHandle handle) {
+    uint32_t index = dense_index(handle);
+    uint32_t last = pos_x.size() - 1;
+
+    removed.push_back(handle.slot);
+    slots[handle.slot].generation++;
+    free_slots.push_back(handle.slot);
+
+    if (index != last) {
+      pos_x[index] = pos_x[last];
+      pos_y[index] = pos_y[last];
+      vel_x[index] = vel_x[last];
+      vel_y[index] = vel_y[last];
+      ids[index] = ids[last];
+      dirty[index] = DIRTY;
+      slots[ids[index]].dense = index;
+    }
+    pos_x.pop_back();
+    pos_y.pop_back();
+    vel_x.pop_back();
+    vel_y.pop_back();
+    ids.pop_back();
+    dirty.pop_back();
+  }
+
+  // Returns true if the handle refers to a live entity.
+  bool alive(EntityHandle handle) const {
+    return handle.slot < slots.size() &&
+      slots[handle.slot].generation == handle.generation;
+  }
+
+  // Returns the dense index of an entity, for use with the arrays below.
+  uint32_t dense_index(EntityHandle handle) const {
+    if (handle.slot >= slots.size() || slots[handle.slot].generation != handle.generation)
+      throw std::out_of_range("Stale entity handle");
+    return slots[handle.slot].dense;
+  }
+
+  // Returns the handle of the entity at a dense index.
+  EntityHandle handle_at(uint32_t index) const {
+    uint32_t slot = ids[index];
+    return EntityHandle { slot, slots[slot].generation };
+  }
+
+  // Sets an entity's velocity.
+  void set_velocity(EntityHandle handle, float vx, float vy) {
+    uint32_t index = dense_index(handle);
+    vel_x[index] = vx;
+    vel_y[index] = vy;
+  }
+
+  // Number of live entities.
+  std::size_t size() const {
+    return pos_x.size();
+  }
+
+  // Moves every entity by its velocity and keeps it inside `bounds`,
+  // bouncing off the edges. Split across `jobs` if given.
+  void update(float dt, const Bounds& bounds, JobSystem* jobs = nullptr) {
+    auto kernel = [&](std::size_t begin, std::size_t end) {
+      integrate(dt, begin, end);
+      clamp_bounds(bounds, begin, end);
+    };
+    if (jobs) {
+      jobs->parallel_for(0, size(), ENTITY_GRAIN, kernel);
+    } else {
+      kernel(0, size());
+    }
+  }
+
+  // pos += vel * dt over [begin, end). Flags entities that moved.
+  void integrate(float dt, std::size_t begin, std::size_t end) {
+    float* px = pos_x.data();
+    float* py = pos_y.data();
+    const float* vx = vel_x.data();
+    const float* vy = vel_y.data();
+    uint32_t* d = dirty.data();
+    std::size_t i = begin;
+
+#ifdef __SSE2__
+    __m128 step = _mm_set1_ps(dt);
+    for (; i + 4 <= end; i += 4) {
+      __m128 x = _mm_loadu_ps(px + i);
+      __m128 y = _mm_loadu_ps(py + i);
+      __m128 nx = _mm_add_ps(x, _mm_mul_ps(_mm_loadu_ps(vx + i), step));
+      __m128 ny = _mm_add_ps(y, _mm_mul_ps(_mm_loadu_ps(vy + i), step));
+      __m128 moved = _mm_or_ps(_mm_cmpneq_ps(nx, x), _mm_cmpneq_ps(ny, y));
+      _mm_storeu_ps(px + i, nx);
+      _mm_storeu_ps(py + i, ny);
+      __m128i flags = _mm_loadu_si128(reinterpret_cast<__m128i*>(d + i));
+      flags = _mm_or_si128(flags, _mm_castps_si128(moved));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), flags);
+    }
+#endif
+
+    for (; i < end; ++i) {
+      float nx = px[i] + vx[i] * dt;
+      float ny = py[i] + vy[i] * dt;
+      if (nx != px[i] || ny != py[i])
+        d[i] = DIRTY;
+      px[i] = nx;
+      py[i] = ny;
+    }
+  }
+
+  // Clamps positions over [begin, end) to `bounds` and reverses the
+  // velocity of anything that hit an edge. Flags entities that changed.
+  void clamp_bounds(const Bounds& bounds, std::size_t begin, std::size_t end) {
+    float* px = pos_x.data();
+    float* py = pos_y.data();
+    float* vx = vel_x.data();
+    float* vy = vel_y.data();
+    uint32_t* d = dirty.data();
+    std::size_t i = begin;
+
+#ifdef __SSE2__
+    __m128 lo_x = _mm_set1_ps(bounds.min_x), hi_x = _mm_set1_ps(bounds.max_x);
+    __m128 lo_y = _mm_set1_ps(bounds.min_y), hi_y = _mm_set1_ps(bounds.max_y);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= end; i += 4) {
+      __m128 x = _mm_loadu_ps(px + i);
+      __m128 y = _mm_loadu_ps(py + i);
+      __m128 cx = _mm_min_ps(_mm_max_ps(x, lo_x), hi_x);
+      __m128 cy = _mm_min_ps(_mm_max_ps(y, lo_y), hi_y);
+      __m128 hit_x = _mm_cmpneq_ps(cx, x);
+      __m128 hit_y = _mm_cmpneq_ps(cy, y);
+      _mm_storeu_ps(px + i, cx);
+      _mm_storeu_ps(py + i, cy);
+      // Flip the sign bit of the velocity on lanes that hit an edge.
+      _mm_storeu_ps(vx + i, _mm_xor_ps(_mm_loadu_ps(vx + i), _mm_and_ps(hit_x, sign)));
+      _mm_storeu_ps(vy + i, _mm_xor_ps(_mm_loadu_ps(vy + i), _mm_and_ps(hit_y, sign)));
+      __m128i flags = _mm_loadu_si128(reinterpret_cast<__m128i*>(d + i));
+      flags = _mm_or_si128(flags, _mm_castps_si128(_mm_or_ps(hit_x, hit_y)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), flags);
+    }
+#endif
+
+    for (; i < end; ++i) {
+      float cx = std::min(std::max(px[i], bounds.min_x), bounds.max_x);
+      float cy = std::min(std::max(py[i], bounds.min_y), bounds.max_y);
+      if (cx != px[i]) {
+        vx[i] = -vx[i];
+        d[i] = DIRTY;
+      }
+      if (cy != py[i]) {
+        vy[i] = -vy[i];
+        d[i] = DIRTY;
+      }
+      px[i] = cx;
+      py[i] = cy;
+    }
+  }
+
+  // Appends the dense indices of all dirty entities to `out`, in order, and
+  // clears their flags.
+  void collect_dirty(std::vector<uint32_t>& out) {
+    uint32_t* d = dirty.data();
+    std::size_t i = 0, n = dirty.size();
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+      __m128i flags = _mm_loadu_si128(reinterpret_cast<__m128i*>(d + i));
+      int mask = _mm_movemask_ps(_mm_castsi128_ps(flags));
+      if (mask == 0)
+        continue;
+      for (int lane = 0; lane < 4; ++lane) {
+        if (mask & (1 << lane))
+          out.push_back(i + lane);
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), zero);
+    }
+#endif
+
+    for (; i < n; ++i) {
+      if (d[i]) {
+        out.push_back(i);
+        d[i] = 0;
+      }
+    }
+  }
+
+  // Returns the ids of entities destroyed since the last call.
+  std::vector<uint32_t> collect_removed() {
+    std::vector<uint32_t> out;
+    out.swap(removed);
+    return out;
+  }
+
+  // Appends one line per entity, "E <id> <x> <y>\n", for the given dense
+  // indices. Positions are written with two decimals.
+  void write_entities(const std::vector<uint32_t>& indices, std::string& out) const {
+    out.reserve(out.size() + indices.size() * 24);
+    char line[64];
+    for (auto i : indices) {
+      char* p = line;
+      *p++ = 'E';
+      *p++ = ' ';
+      p = write_uint(p, ids[i]);
+      *p++ = ' ';
+      p = write_fixed(p, pos_x[i]);
+      *p++ = ' ';
+      p = write_fixed(p, pos_y[i]);
+      *p++ = '\n';
+      out.append(line, p - line);
+    }
+  }
+
+  // Appends one line per entity, "M <shard> <id> <x> <y>\n", for the given
+  // dense indices: how clients of a neighbouring shard see them.
+  void write_mirrors(const std::vector<uint32_t>& indices, int shard, std::string& out) const {
+    out.reserve(out.size() + indices.size() * 28);
+    char line[80];
+    for (auto i : indices) {
+      char* p = line;
+      *p++ = 'M';
+      *p++ = ' ';
+      p = write_uint(p, shard);
+      *p++ = ' ';
+      p = write_uint(p, ids[i]);
+      *p++ = ' ';
+      p = write_fixed(p, pos_x[i]);
+      *p++ = ' ';
+      p = write_fixed(p, pos_y[i]);
+      *p++ = '\n';
+      out.append(line, p - line);
+    }
+  }
+
+  // Writes the entity at a dense index as an "E <id> <x> <y>" line padded
+  // with spaces to exactly ENTITY_RECORD_SIZE bytes, so a record can be
+  // overwritten in place when the entity changes.
+  void write_record(uint32_t index, char* record) const {
+    char* p = record;
+    *p++ = 'E';
+    *p++ = ' ';
+    p = write_uint(p, ids[index]);
+    *p++ = ' ';
+    p = write_fixed(p, pos_x[index]);
+    *p++ = ' ';
+    p = write_fixed(p, pos_y[index]);
+    std::fill(p, record + ENTITY_RECORD_SIZE - 1, ' ');
+    record[ENTITY_RECORD_SIZE - 1] = '\n';
+  }
+
+  // Appends one line per removed entity id, "R <id>\n".
+  static void write_removed(const std::vector<uint32_t>& removed_ids, std::string& out) {
+    char line[32];
+    for (auto id : removed_ids) {
+      char* p = line;
+      *p++ = 'R';
+      *p++ = ' ';
+      p = write_uint(p, id);
+      *p++ = '\n';
+      out.append(line, p - line);
+    }
+  }
+
+  // Component arrays, indexed densely.
+  const std::vector<float>& get_pos_x() const { return pos_x; }
+  const std::vector<float>& get_pos_y() const { return pos_y; }
+  const std::vector<float>& get_vel_x() const { return vel_x; }
+  const std::vector<float>& get_vel_y() const { return vel_y; }
+  const std::vector<uint32_t>& get_ids() const { return ids; }
+
+private:
+  enum : uint32_t { DIRTY = 0xffffffff };
+
+  // Writes n in decimal and returns the end. snprintf is far too slow for
+  // a full world's worth of lines per tick.
+  static char* write_uint(char* p, uint64_t n) {
+    char digits[20];
+    int count = 0;
+    do {
+      digits[count++] = '0' + n % 10;
+      n /= 10;
+    } while (n);
+    while (count)
+      *p++ = digits[--count];
+    return p;
+  }
+
+  // Writes v with two decimals and returns the end. Clamped to +-1e10 so
+  // a line always fits in a record.
+  static char* write_fixed(char* p, float v) {
+    double clamped = std::isnan(v) ? 0 : std::min(std::max((double) v, -1e10), 1e10);
+    long long hundredths = std::llround(clamped * 100);
+    if (hundredths < 0) {
+      *p++ = '-';
+      hundredths = -hundredths;
+    }
+    p = write_uint(p, hundredths / 100);
+    *p++ = '.';
+    *p++ = '0' + hundredths / 10 % 10;
+    *p++ = '0' + hundredths % 10;
+    return p;
+  }
+
+  struct Slot {
+    uint32_t dense;
+    uint32_t generation;
+  };
+
+  std::vector<float> pos_x;
+  std::vector<float> pos_y;
+  std::vector<float> vel_x;
+  std::vector<float> vel_y;
+  std::vector<uint32_t> dirty;   // All ones when dirty, so SIMD can OR masks in.
+  std::vector<uint32_t> ids;     // Slot of each dense entity; its id on the wire.
+
+  std::vector<Slot> slots;
+  std::vector<uint32_t> free_slots;
+  std::vector<uint32_t> removed;
+};
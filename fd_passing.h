@@ -0,0 +1,93 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+// Most file descriptors sent in a single message.
+#define MAX_PASSED_FDS 8
+
+/**
+ * Sends file descriptors over a connected Unix domain socket with
+ * SCM_RIGHTS, along with a small payload. Returns false on failure.
+ */
+inline bool send_fds(int sock, const int* fds, int count, const std::string& payload) {
+  if (count < 0 || count > MAX_PASSED_FDS || payload.empty())
+    return false;
+
+  char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+  std::memset(control, 0, sizeof(control));
+
+  struct iovec iov;
+  iov.iov_base = const_cast<char*>(payload.data());
+  iov.iov_len = payload.size();
+
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+  std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  return sent == (ssize_t) payload.size();
+}
+
+/**
+ * Receives file descriptors sent with send_fds. Returns the number of
+ * descriptors stored in fds, or -1 on failure or end of file. Up to 4 KiB
+ * of payload is stored in `payload`. Any descriptors past max_count are
+ * closed.
+ */
+inline int recv_fds(int sock, int* fds, int max_count, std::string& payload) {
+  char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+  char buffer[4096];
+
+  struct iovec iov;
+  iov.iov_base = buffer;
+  iov.iov_len = sizeof(buffer);
+
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t received;
+  do {
+    received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (received < 0 && errno == EINTR);
+  if (received <= 0)
+    return -1;
+  payload.assign(buffer, received);
+
+  int count = 0;
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int* data = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+    for (int i = 0; i < n; ++i) {
+      int fd;
+      std::memcpy(&fd, data + i, sizeof(int));
+      if (count < max_count)
+        fds[count++] = fd;
+      else
+        close(fd);
+    }
+  }
+  return count;
+}
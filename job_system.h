@@ -0,0 +1,292 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+// Jobs each worker's deque can hold before new jobs run inline.
+#define JOB_DEQUE_CAPACITY 4096
+
+/**
+ * Counts outstanding jobs. Jobs started with a counter increment it and
+ * decrement it when they finish, so waiting for it to reach zero waits for
+ * all of them. A job may itself wait on another job's counter, which is how
+ * dependencies between jobs are expressed.
+ */
+struct JobCounter {
+  std::atomic<int> pending { 0 };
+
+  bool done() const {
+    return pending.load(std::memory_order_acquire) == 0;
+  }
+};
+
+struct Job {
+  std::function<void()> fn;
+  JobCounter* counter;
+};
+
+/**
+ * Fixed size Chase-Lev work stealing deque. The owning worker pushes and
+ * pops at the bottom; any other thread may steal from the top.
+ * See Lê et al., "Correct and Efficient Work-Stealing for Weak Memory
+ * Models" (PPoPP 2013).
+ */
+class WorkStealingDeque {
+public:
+  WorkStealingDeque() : top(0), bottom(0), buffer(JOB_DEQUE_CAPACITY) {}
+
+  // Owner only. Returns false if the deque is full.
+  bool push(Job* job) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    if (b - t >= JOB_DEQUE_CAPACITY)
+      return false;
+    buffer[b & (JOB_DEQUE_CAPACITY - 1)].store(job, std::memory_order_relaxed);
+    bottom.store(b + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Owner only. Returns the most recently pushed job, or null.
+  Job* pop() {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    Job* job = buffer[b & (JOB_DEQUE_CAPACITY - 1)].load(std::memory_order_relaxed);
+    if (t == b) {
+      // Last job; race any thieves for it.
+      if (!top.compare_exchange_strong(t, t + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed))
+        job = nullptr;
+      bottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return job;
+  }
+
+  // Any thread. Returns true if there may be nothing to steal.
+  bool empty() const {
+    return top.load() >= bottom.load();
+  }
+
+  // Any thread. Returns the oldest job, or null if empty or lost a race.
+  Job* steal() {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+    if (t >= b)
+      return nullptr;
+
+    Job* job = buffer[t & (JOB_DEQUE_CAPACITY - 1)].load(std::memory_order_relaxed);
+    if (!top.compare_exchange_strong(t, t + 1,
+          std::memory_order_seq_cst, std::memory_order_relaxed))
+      return nullptr;
+    return job;
+  }
+
+private:
+  alignas(64) std::atomic<int64_t> top;
+  alignas(64) std::atomic<int64_t> bottom;
+  std::vector<std::atomic<Job*>> buffer;
+};
+
+/**
+ * Work stealing job system. The thread that creates it is worker 0 and
+ * runs jobs while it waits; the rest are background threads. Jobs started
+ * from any other thread just run inline.
+ */
+class JobSystem {
+public:
+  // Uses one background worker per core other than the caller's by default.
+  explicit JobSystem(unsigned int workers = default_workers()) :
+    deques(workers + 1), running(true), sleeping(0), epoch(0) {
+    worker_index() = 0;
+    worker_owner() = this;
+    for (unsigned int i = 1; i <= workers; ++i) {
+      threads.push_back(std::thread(&JobSystem::worker_loop, this, i));
+    }
+  }
+
+  ~JobSystem() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      running = false;
+    }
+    wake.notify_all();
+    for (auto &t : threads)
+      t.join();
+  }
+
+  // Number of threads running jobs, including the creating thread.
+  std::size_t size() const {
+    return deques.size();
+  }
+
+  // Starts a job. `counter` is incremented now and decremented when the job
+  // has finished.
+  void run(std::function<void()> fn, JobCounter& counter) {
+    counter.pending.fetch_add(1, std::memory_order_relaxed);
+    Job* job = new Job { std::move(fn), &counter };
+
+    int index = current_worker();
+    if (index < 0 || !deques[index].push(job)) {
+      execute(job);
+      return;
+    }
+    wake_one();
+  }
+
+  // Waits for every job on `counter` to finish, running other jobs
+  // meanwhile rather than blocking.
+  void wait(const JobCounter& counter) {
+    int index = current_worker();
+    while (!counter.done()) {
+      Job* job = index >= 0 ? find_job(index) : nullptr;
+      if (job)
+        execute(job);
+      else
+        std::this_thread::yield();
+    }
+  }
+
+  // Calls fn(begin, end) over [first, last) in chunks of at most `grain`,
+  // in parallel, and returns once all chunks are done.
+  template<typename F>
+  void parallel_for(std::size_t first, std::size_t last, std::size_t grain, F fn) {
+    if (first >= last)
+      return;
+    grain = std::max<std::size_t>(grain, 1);
+
+    JobCounter counter;
+    for (std::size_t begin = first; begin < last; begin += grain) {
+      std::size_t end = std::min(last, begin + grain);
+      run([=]() { fn(begin, end); }, counter);
+    }
+    wait(counter);
+  }
+
+  static unsigned int default_workers() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 0;
+  }
+
+private:
+  // This thread's worker index in whichever JobSystem it belongs to.
+  static int& worker_index() {
+    static thread_local int index = -1;
+    return index;
+  }
+
+  // Which JobSystem this thread belongs to.
+  static JobSystem*& worker_owner() {
+    static thread_local JobSystem* system = nullptr;
+    return system;
+  }
+
+  // Returns this thread's deque index in this system, or -1.
+  int current_worker() const {
+    if (worker_owner() != this)
+      return -1;
+    return worker_index();
+  }
+
+  // Wakes a sleeping worker, if any, after a push. The fence pairs with the
+  // one in worker_loop: either we see the worker going to sleep, or it sees
+  // our job before it waits.
+  void wake_one() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed) == 0)
+      return;
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex);
+      epoch++;
+    }
+    wake.notify_one();
+  }
+
+  // Returns true if any deque may have a job in it.
+  bool has_work() const {
+    for (auto const &d : deques) {
+      if (!d.empty())
+        return true;
+    }
+    return false;
+  }
+
+  // Runs a job and signals its counter.
+  void execute(Job* job) {
+    job->fn();
+    job->counter->pending.fetch_sub(1, std::memory_order_release);
+    delete job;
+  }
+
+  // Pops from our own deque, or steals from a random other one.
+  Job* find_job(int index) {
+    Job* job = deques[index].pop();
+    if (job)
+      return job;
+
+    static thread_local std::minstd_rand rng(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::size_t n = deques.size();
+    std::size_t start = rng() % n;
+    for (std::size_t i = 0; i < n; ++i) {
+      std::size_t victim = (start + i) % n;
+      if ((int) victim == index)
+        continue;
+      job = deques[victim].steal();
+      if (job)
+        return job;
+    }
+    return nullptr;
+  }
+
+  // Background worker. Spins briefly when out of work, then sleeps until a
+  // job is pushed.
+  void worker_loop(int index) {
+    worker_index() = index;
+    worker_owner() = this;
+
+    int idle = 0;
+    while (running.load(std::memory_order_relaxed)) {
+      Job* job = find_job(index);
+      if (job) {
+        execute(job);
+        idle = 0;
+      } else if (++idle < 64) {
+        std::this_thread::yield();
+      } else {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        unsigned long seen = epoch;
+        sleeping++;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!has_work()) {
+          wake.wait(lock, [&]() {
+            return epoch != seen || !running.load(std::memory_order_relaxed);
+          });
+        }
+        sleeping--;
+        idle = 0;
+      }
+    }
+  }
+
+  std::vector<WorkStealingDeque> deques;
+  std::vector<std::thread> threads;
+  std::atomic<bool> running;
+  std::atomic<int> sleeping;
+  std::mutex sleep_mutex;
+  unsigned long epoch;    // Bumped under sleep_mutex for each wakeup.
+  std::condition_variable wake;
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+/**
+ * Classic token bucket. Tokens refill continuously at `rate` per second up
+ * to `burst`. A rate of 0 means unlimited.
+ */
+class TokenBucket {
+public:
+  typedef std::chrono::steady_clock clock;
+
+  TokenBucket(double rate = 0, double burst = 0) :
+    rate(rate), burst(burst), tokens(burst), last(clock::now()) {}
+
+  // Takes n tokens if they are available. Returns false otherwise.
+  bool consume(double n) {
+    if (rate == 0)
+      return true;
+    refill();
+    if (tokens < n)
+      return false;
+    tokens -= n;
+    return true;
+  }
+
+  // Takes n tokens unconditionally, going into debt if needed.
+  void force_consume(double n) {
+    if (rate == 0)
+      return;
+    refill();
+    tokens -= n;
+  }
+
+  // Returns how long until n tokens are available. Requests larger than the
+  // burst are treated as a full bucket so they can't wait forever.
+  std::chrono::microseconds time_until(double n) {
+    if (rate == 0)
+      return std::chrono::microseconds(0);
+    refill();
+    double missing = std::min(n, burst) - tokens;
+    if (missing <= 0)
+      return std::chrono::microseconds(0);
+    return std::chrono::microseconds((long long) (missing / rate * 1e6) + 1);
+  }
+
+private:
+  // Adds the tokens earned since the last refill.
+  void refill() {
+    clock::time_point now = clock::now();
+    double elapsed = std::chrono::duration<double>(now - last).count();
+    tokens = std::min(burst, tokens + elapsed * rate);
+    last = now;
+  }
+
+  double rate;
+  double burst;
+  double tokens;
+  clock::time_point last;
+};
+
+/**
+ * What to do with a client that goes over its inbound limits.
+ *
+ * PAUSE:       stop reading from the socket until the buckets refill. Nothing
+ *              is lost; TCP flow control pushes back on the client.
+ * DROP:        discard the message and keep reading.
+ * DISCONNECT:  close the connection.
+ */
+enum class LimitAction { PAUSE, DROP, DISCONNECT };
+
+/**
+ * Inbound limits for one client. Rates of 0 are unlimited.
+ */
+struct RateLimitConfig {
+  double messages_per_sec = 60;
+  double message_burst = 120;
+  double bytes_per_sec = 64 * 1024;
+  double byte_burst = 128 * 1024;
+  LimitAction action = LimitAction::PAUSE;
+};
+
+/**
+ * Inbound counters for one client. Updated on the io thread and read from
+ * the main thread, hence atomic.
+ */
+struct RateLimitStats {
+  std::atomic<unsigned long> accepted_messages { 0 };
+  std::atomic<unsigned long> accepted_bytes { 0 };
+  std::atomic<unsigned long> dropped_messages { 0 };
+  std::atomic<unsigned long> dropped_bytes { 0 };
+  std::atomic<unsigned long> pauses { 0 };
+  std::atomic<unsigned long> disconnects { 0 };
+};
+
+/**
+ * Plain copy of RateLimitStats, for summing and reporting.
+ */
+struct RateLimitTotals {
+  unsigned long accepted_messages = 0;
+  unsigned long accepted_bytes = 0;
+  unsigned long dropped_messages = 0;
+  unsigned long dropped_bytes = 0;
+  unsigned long pauses = 0;
+  unsigned long disconnects = 0;
+};
+
+/**
+ * Pair of token buckets limiting a client's inbound messages and bytes.
+ * Only touched from the io thread.
+ */
+class RateLimiter {
+public:
+  explicit RateLimiter(const RateLimitConfig& config = RateLimitConfig()) :
+    config(config),
+    messages(config.messages_per_sec, config.message_burst),
+    bytes(config.bytes_per_sec, config.byte_burst) {}
+
+  // Returns true and takes the tokens if a message of this size is allowed
+  // right now. Both buckets must have room, or neither is charged.
+  bool admit(std::size_t size) {
+    if (messages.time_until(1).count() > 0 || bytes.time_until(size).count() > 0)
+      return false;
+    messages.force_consume(1);
+    bytes.force_consume(size);
+    return true;
+  }
+
+  // Charges a message that was let through after a pause.
+  void charge(std::size_t size) {
+    messages.force_consume(1);
+    bytes.force_consume(size);
+  }
+
+  // Returns how long until a message of this size would be admitted.
+  std::chrono::microseconds time_until(std::size_t size) {
+    return std::max(messages.time_until(1), bytes.time_until(size));
+  }
+
+  // Returns the action to take when over the limit.
+  LimitAction get_action() const {
+    return config.action;
+  }
+
+private:
+  RateLimitConfig config;
+  TokenBucket messages;
+  TokenBucket bytes;
+};
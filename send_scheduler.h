@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * Configuration for one outbound channel.
+ *
+ * priority:  starting score of a message queued on this channel.
+ * weight:    score gained for every tick a message sits deferred, so low
+ *            priority channels still get through eventually.
+ * max_age:   number of ticks a message may wait before it is evicted as
+ *            stale. 0 means messages never go stale.
+ */
+struct ChannelConfig {
+  int priority;
+  int weight;
+  unsigned int max_age;
+};
+
+/**
+ * Running counters for one outbound channel.
+ */
+struct ChannelStats {
+  unsigned long sent_messages = 0;
+  unsigned long sent_bytes = 0;
+  unsigned long deferred = 0;   // Message-ticks spent waiting in the queue.
+  unsigned long evicted = 0;    // Messages dropped for being stale.
+};
+
+/**
+ * Per-connection outbound scheduler. Messages are queued on prioritized
+ * channels and released once per tick, highest score first, until the
+ * connection's byte budget for that tick is used up. Order within a single
+ * channel is always preserved.
+ *
+ * Not thread safe; owned and driven by the main thread.
+ */
+class SendScheduler {
+public:
+  // A budget of 0 means unlimited.
+  explicit SendScheduler(std::size_t bytes_per_tick = 0) :
+    budget(bytes_per_tick), tick(0) {}
+
+  // Adds a channel and returns its id.
+  int add_channel(const ChannelConfig& config) {
+    channels.push_back(Channel());
+    channels.back().config = config;
+    return channels.size() - 1;
+  }
+
+  // Sets the number of bytes that may be released per tick. 0 is unlimited.
+  void set_budget(std::size_t bytes_per_tick) {
+    budget = bytes_per_tick;
+  }
+
+  // Queues a message on the given channel.
+  void push(int channel, std::string message) {
+    get_channel(channel).queue.push_back(Item { std::move(message), tick });
+  }
+
+  // Returns true if any channel has queued messages.
+  bool empty() const {
+    for (auto const &c : channels) {
+      if (!c.queue.empty())
+        return false;
+    }
+    return true;
+  }
+
+  // Advances one tick and returns the messages to send, in send order.
+  // Stale messages are evicted first; whatever does not fit in the budget
+  // stays queued and gains priority for the next tick.
+  std::vector<std::string> next_tick() {
+    std::vector<std::string> out;
+    released.clear();
+    evict_stale();
+
+    std::size_t remaining = budget;
+    std::vector<bool> blocked(channels.size(), false);
+    for (;;) {
+      int best = pick_channel(blocked);
+      if (best < 0)
+        break;
+
+      Channel &c = channels[best];
+      std::size_t size = c.queue.front().message.size();
+
+      // Always let one message out per tick, even an oversized one, so a
+      // message larger than the whole budget can't wedge its channel.
+      if (budget != 0 && size > remaining && !out.empty()) {
+        blocked[best] = true;
+        continue;
+      }
+
+      out.push_back(std::move(c.queue.front().message));
+      released.push_back(Released { best, c.queue.front().queued_at });
+      c.queue.pop_front();
+      c.stats.sent_messages++;
+      c.stats.sent_bytes += size;
+      remaining = size > remaining ? 0 : remaining - size;
+    }
+
+    for (auto &c : channels)
+      c.stats.deferred += c.queue.size();
+
+    tick++;
+    return out;
+  }
+
+  // Advances one tick without releasing anything, for a client that can't
+  // be sent to right now. Stale messages are still evicted, so a channel's
+  // max_age bounds how much builds up.
+  void hold_tick() {
+    released.clear();
+    evict_stale();
+    for (auto &c : channels)
+      c.stats.deferred += c.queue.size();
+    tick++;
+  }
+
+  // Puts messages from the last next_tick() batch, from index `first` on,
+  // back at the front of their channels, as if they'd never been released.
+  // For when a send fails partway through a batch.
+  void requeue(std::vector<std::string>& batch, std::size_t first) {
+    for (std::size_t i = batch.size(); i-- > first; ) {
+      Channel &c = channels[released[i].channel];
+      c.stats.sent_messages--;
+      c.stats.sent_bytes -= batch[i].size();
+      c.queue.push_front(Item { std::move(batch[i]), released[i].queued_at });
+    }
+    released.resize(std::min(first, released.size()));
+  }
+
+  // Returns the counters for the given channel.
+  const ChannelStats& get_stats(int channel) const {
+    return get_channel(channel).stats;
+  }
+
+  // Resets every channel's counters to zero.
+  void clear_stats() {
+    for (auto &c : channels)
+      c.stats = ChannelStats();
+  }
+
+  // Returns the number of messages waiting on the given channel.
+  std::size_t queued(int channel) const {
+    return get_channel(channel).queue.size();
+  }
+
+  // Returns the number of channels.
+  std::size_t channel_count() const {
+    return channels.size();
+  }
+
+private:
+  struct Item {
+    std::string message;
+    unsigned long queued_at;
+  };
+
+  // Where a message in the last batch came from.
+  struct Released {
+    int channel;
+    unsigned long queued_at;
+  };
+
+  struct Channel {
+    ChannelConfig config;
+    ChannelStats stats;
+    std::deque<Item> queue;
+  };
+
+  Channel& get_channel(int channel) {
+    if (channel < 0 || channel >= (int) channels.size())
+      throw std::out_of_range("No such channel");
+    return channels[channel];
+  }
+
+  const Channel& get_channel(int channel) const {
+    if (channel < 0 || channel >= (int) channels.size())
+      throw std::out_of_range("No such channel");
+    return channels[channel];
+  }
+
+  // Drops messages that have waited longer than their channel allows.
+  // Queues are FIFO, so the oldest messages are always at the front.
+  void evict_stale() {
+    for (auto &c : channels) {
+      if (c.config.max_age == 0)
+        continue;
+      while (!c.queue.empty() &&
+          tick - c.queue.front().queued_at > c.config.max_age) {
+        c.queue.pop_front();
+        c.stats.evicted++;
+      }
+    }
+  }
+
+  // Returns the channel whose head message has the highest aged score, or
+  // -1 if nothing is sendable.
+  int pick_channel(const std::vector<bool>& blocked) const {
+    int best = -1;
+    long best_score = 0;
+    for (std::size_t i = 0; i < channels.size(); ++i) {
+      const Channel &c = channels[i];
+      if (blocked[i] || c.queue.empty())
+        continue;
+      long age = tick - c.queue.front().queued_at;
+      long score = c.config.priority + age * c.config.weight;
+      if (best < 0 || score > best_score) {
+        best = i;
+        best_score = score;
+      }
+    }
+    return best;
+  }
+
+  std::vector<Channel> channels;
+  std::vector<Released> released;   // The last batch, in send order.
+  std::size_t budget;
+  unsigned long tick;
+};
@@ -1,28 +1,387 @@
 #include "threadsafe_queue.h"
+#include "send_scheduler.h"
+#include "rate_limiter.h"
+#include "shm_transport.h"
+#include "fd_passing.h"
+#include "job_system.h"
+#include "entity_store.h"
+#include "snapshot_cache.h"
+#include "session.h"
+#include "shard_link.h"
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/bind.hpp>
+#include <boost/function.hpp>
 #include <boost/asio.hpp>
 #include <iostream>
 #include <string>
 #include <chrono>
 #include <thread>
 #include <ctime>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <sstream>
 
 #define PORT 9000
 
+// Default per-client outbound budget, in bytes per tick. 0 is unlimited.
+#define BYTES_PER_TICK 0
+
+// How long a send to a shared memory peer waits on a full ring.
+#define SHM_SEND_TIMEOUT std::chrono::seconds(1)
+
+// Bytes of join snapshot written per async write, and how long a shared
+// memory joiner waits before retrying a full ring.
+#define JOIN_CHUNK (64 * 1024)
+#define JOIN_RETRY std::chrono::milliseconds(1)
+
+// Longest line a client may send; longer ones are split.
+#define MAX_LINE (64 * 1024)
+
+// Clients flushed per job when flushing in parallel.
+#define FLUSH_GRAIN 16
+
+// Tick length of the main loop.
+#define TICK std::chrono::milliseconds(300)
+
+// Side length of the square world, and how many entities roam it.
+#define WORLD_SIZE 1000.0f
+#define WORLD_ENTITIES 1000
+
+// Width of the strip along a shard boundary mirrored to the neighbour.
+#define MIRROR_MARGIN 50.0f
+
 using boost::asio::ip::tcp;
+namespace local = boost::asio::local;
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+
+/**
+ * Represents one client connection, whatever the transport. Holds the
+ * inbound queue and rate limiter and the outbound scheduler; subclasses do
+ * the actual reading and writing.
+ */
+class Connection : public boost::enable_shared_from_this<Connection> {
+public:
+  typedef boost::shared_ptr<Connection> pointer;
+
+  virtual ~Connection() {}
+
+  // When connection starts, begin reading.
+  void start() {
+    start_read();
+  }
+
+  // Sends a message to this client. Returns true if write was successful.
+  virtual bool send(std::string message) = 0;
+
+  // Closes the connection and cancels anything waiting on it, so the peer
+  // sees it go. Runs on the io thread.
+  virtual void close() = 0;
+
+  // Queues a message on one of this client's outbound channels.
+  void queue(int channel, std::string message) {
+    scheduler.push(channel, std::move(message));
+  }
+
+  // Streams join data (handshake, replay, snapshot) to this client on the
+  // io thread, ahead of anything queued. flush() holds everything back until
+  // it's all written, so nothing the main thread sends can overtake or
+  // interleave with it. The parts are shared, never copied.
+  void start_join(std::vector<std::shared_ptr<const std::string>> parts) {
+    join_parts = std::move(parts);
+    join_part = 0;
+    join_offset = 0;
+    joining = true;
+    io_service.post(boost::bind(&Connection::send_join_chunk, shared_from_this()));
+  }
+
+  // Sends whatever the scheduler releases this tick, recording it in the
+  // session's history. Returns false if a write failed, in which case the
+  // unsent messages are put back on the scheduler so a resumed session
+  // still gets them. If part of the failed message went out, the client is
+  // already past the end of the history and can't resume, so it's dropped.
+  // A kicked client fails right away, even with nothing to send.
+  bool flush() {
+    if (kicked || joining)
+      return !kicked;
+    std::vector<std::string> batch = scheduler.next_tick();
+    for (std::size_t i = 0; i < batch.size(); ++i) {
+      partial_write = false;
+      if (!send(batch[i])) {
+        scheduler.requeue(batch, partial_write ? i + 1 : i);
+        return false;
+      }
+      if (session)
+        session->history.append(batch[i]);
+    }
+    return true;
+  }
+
+  // Sets the callback run on the io thread once the client's greeting
+  // arrives. Must be set before start().
+  void on_greeting(boost::function<void (pointer)> callback) {
+    greeting_callback = callback;
+  }
+
+  // The session token and stream offset the client asked to resume from,
+  // or an empty token for a new session. Valid once greeted.
+  const std::string& get_resume_token() {
+    return resume_token;
+  }
+
+  uint64_t get_resume_offset() {
+    return resume_offset;
+  }
+
+  // Treats the client as already greeted, for connections taken over from
+  // another shard, optionally as if it had asked to resume `token` at
+  // `offset`. Must be called before start().
+  void skip_greeting(const std::string& token = std::string(), uint64_t offset = 0) {
+    greeted = true;
+    resume_token = token;
+    resume_offset = offset;
+  }
+
+  // Returns true while join data is still being written.
+  bool is_joining() {
+    return joining;
+  }
+
+  // Returns the session this connection belongs to.
+  std::shared_ptr<Session> get_session() {
+    return session;
+  }
+
+  // Attaches this connection to a session. Main thread only.
+  void set_session(std::shared_ptr<Session> new_session) {
+    session = new_session;
+  }
+
+  // Returns this client's outbound scheduler.
+  SendScheduler& get_scheduler() {
+    return scheduler;
+  }
+
+  // Returns this client's inbound rate limiting counters.
+  const RateLimitStats& get_limit_stats() {
+    return limit_stats;
+  }
+
+  // Returns true if there are messages in the queue.
+  bool has_messages() {
+    return !message_queue.empty();
+  }
+  
+  // Removes a message and returns it.
+  std::string pop_message() { 
+    if (!has_messages()) 
+      throw std::logic_error("No messages"); 
+    return message_queue.pop(); 
+  }
+
+protected:
+  Connection(boost::asio::io_service& io_service, const RateLimitConfig& limits)
+    : io_service(io_service), limiter(limits), resume_timer(io_service),
+      kicked(false), partial_write(false), joining(false), join_part(0), join_offset(0),
+      greeted(false), resume_offset(0) {}
+
+  // Wait for and read the next message.
+  virtual void start_read() = 0;
+
+  // Writes the join data a chunk at a time using next_join_chunk() and
+  // advance_join(), then calls join_done(). Runs on the io thread.
+  virtual void send_join_chunk() = 0;
+
+  // Points at the next unsent chunk of join data, at most JOIN_CHUNK bytes.
+  // Returns false once everything has been sent.
+  bool next_join_chunk(const char*& data, std::size_t& size) {
+    while (join_part < join_parts.size() &&
+        join_offset >= join_parts[join_part]->size()) {
+      join_part++;
+      join_offset = 0;
+    }
+    if (join_part >= join_parts.size())
+      return false;
+
+    const std::string &part = *join_parts[join_part];
+    data = part.data() + join_offset;
+    size = std::min<std::size_t>(JOIN_CHUNK, part.size() - join_offset);
+    return true;
+  }
+
+  // Marks `size` bytes of join data as sent.
+  void advance_join(std::size_t size) {
+    join_offset += size;
+  }
+
+  // Hands the connection back to the main thread once the join data is out.
+  void join_done() {
+    join_parts.clear();
+    joining = false;
+  }
+
+  // Adds bytes read from a stream transport and handles each complete
+  // line as a message, so the rate limiter counts lines rather than reads.
+  // Returns true if reading should continue right away.
+  bool handle_input(const char* data, std::size_t size) {
+    input.append(data, size);
+    return handle_lines();
+  }
+
+  // Handles the complete lines buffered in `input`. Stops early if a line
+  // pauses or disconnects the client; the rest wait for handle_resume().
+  // Returns true if reading should continue right away.
+  bool handle_lines() {
+    std::size_t start = 0;
+    bool more = true;
+    while (more) {
+      std::size_t newline = input.find('\n', start), end;
+      if (newline != std::string::npos)
+        end = newline + 1;
+      else if (input.size() - start >= MAX_LINE)
+        end = start + MAX_LINE;
+      else
+        break;
+      more = handle_message(input.substr(start, end - start));
+      start = end;
+    }
+    input.erase(0, start);
+    return more;
+  }
+
+  // Checks a received message against the rate limiter, on the io thread,
+  // and queues it. Returns true if reading should continue right away.
+  bool handle_message(const std::string& message) {
+    if (!greeted) {
+      return handle_greeting(message);
+    }
+    if (limiter.admit(message.size())) {
+      accept_message(message);
+      return true;
+    }
+    return limit_exceeded(message);
+  }
+
+  // Parses the client's first line, "HELLO" or "RESUME <token> <offset>",
+  // and reports it with the greeting callback. Anything else starts a new
+  // session and is treated as an ordinary message. Input is buffered until
+  // the whole line is in, however the transport splits it.
+  bool handle_greeting(const std::string& data) {
+    greeting_line += data;
+    std::size_t newline = greeting_line.find('\n');
+    if (newline == std::string::npos && greeting_line.size() < MAX_LINE)
+      return true;
+
+    greeted = true;
+    std::string rest;
+    rest.swap(greeting_line);
+    if (newline != std::string::npos) {
+      std::istringstream line(rest.substr(0, newline));
+      std::string command;
+      line >> command;
+      if (command == "HELLO") {
+        rest.erase(0, newline + 1);
+      } else if (command == "RESUME" && line >> resume_token >> resume_offset) {
+        rest.erase(0, newline + 1);
+      } else {
+        resume_token.clear();
+      }
+    }
+
+    if (greeting_callback)
+      greeting_callback(shared_from_this());
+    return rest.empty() || handle_message(rest);
+  }
+
+  // Queues a message that passed the rate limiter.
+  void accept_message(const std::string& message) {
+    limit_stats.accepted_messages++;
+    limit_stats.accepted_bytes += message.size();
+    message_queue.push(message);
+  }
+
+  // Applies the configured action to a message over the limit. Returns true
+  // if reading should continue right away.
+  bool limit_exceeded(const std::string& message) {
+    switch (limiter.get_action()) {
+      case LimitAction::DROP:
+        limit_stats.dropped_messages++;
+        limit_stats.dropped_bytes += message.size();
+        return true;
+
+      case LimitAction::DISCONNECT: {
+        std::cerr << "[read] client over rate limit, disconnecting.\n";
+        limit_stats.disconnects++;
+        kicked = true;
+        return false;
+      }
+
+      case LimitAction::PAUSE:
+      default:
+        // Hold on to the message and stop reading until the buckets refill.
+        limit_stats.pauses++;
+        resume_timer.expires_from_now(limiter.time_until(message.size()));
+        resume_timer.async_wait(boost::bind(&Connection::handle_resume,
+              shared_from_this(), message, boost::asio::placeholders::error));
+        return false;
+    }
+  }
+
+  // Callback for when a paused connection may read again.
+  void handle_resume(const std::string& message, const boost::system::error_code& error) {
+    if (error)
+      return;
+    limiter.charge(message.size());
+    accept_message(message);
+    if (handle_lines())
+      start_read();
+  }
+
+  boost::asio::io_service& io_service;
+  ThreadSafeQueue<std::string> message_queue;
+  RateLimiter limiter;
+  RateLimitStats limit_stats;
+  std::string input;    // Unframed bytes read so far, io thread only.
+  boost::asio::steady_timer resume_timer;
+
+  // Set on the io thread when the connection should be dropped. The main
+  // thread drops it on the next flush.
+  std::atomic<bool> kicked;
+
+  // Set by send() when a failed write got part of the message out.
+  bool partial_write;
+
+  // Set while the join data is being written on the io thread, which owns
+  // the join_* members until then.
+  std::atomic<bool> joining;
+  std::vector<std::shared_ptr<const std::string>> join_parts;
+  std::size_t join_part;
+  std::size_t join_offset;
+
+  // Greeting state, written on the io thread before the greeting callback.
+  bool greeted;
+  std::string greeting_line;    // The greeting so far, until its newline.
+  std::string resume_token;
+  uint64_t resume_offset;
+  boost::function<void (pointer)> greeting_callback;
+
+  std::shared_ptr<Session> session;
+  SendScheduler scheduler;
+};
 
 /**
  * Represents one TCP connection to a client.
  */
-class TcpConnection : public boost::enable_shared_from_this<TcpConnection> {
+class TcpConnection : public Connection {
 public:
   typedef boost::shared_ptr<TcpConnection> pointer;
 
   // Create a shared pointer to this TCP connection.
-  static pointer create(boost::asio::io_service& io_service) {
-    return pointer(new TcpConnection(io_service));
+  static pointer create(boost::asio::io_service& io_service,
+      const RateLimitConfig& limits = RateLimitConfig()) {
+    return pointer(new TcpConnection(io_service, limits));
   }
 
   // Returns this connection's socket.
@@ -30,14 +389,6 @@ public:
     return socket;
   }
 
-  // When connection starts, begin reading.
-  void start() {
-    socket.async_read_some(boost::asio::buffer(rcvbuf),
-        boost::bind(&TcpConnection::handle_read, shared_from_this(),
-          boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
-  }
-  
   // Sends a message to this client. Returns true if write was successful.
   bool send(std::string message) {
     if (!socket.is_open()) {
@@ -45,7 +396,8 @@ public:
     }
     
     boost::system::error_code error;
-    boost::asio::write(socket, boost::asio::buffer(message), error);
+    std::size_t written = boost::asio::write(socket, boost::asio::buffer(message), error);
+    partial_write = error && written > 0;
     
     // If we get these errors, it's likely a clean disconnect.
     if ((error == boost::asio::error::eof) ||
@@ -60,81 +412,502 @@ public:
     
     return true;
   }
-  
-  // Returns true if there are messages in the queue.
-  bool has_messages() {
-    return !message_queue.empty();
+
+  // Closes the socket, cancelling any read.
+  void close() {
+    boost::system::error_code ignored;
+    resume_timer.cancel(ignored);
+    socket.close(ignored);
   }
-  
-  // Removes a message and returns it.
-  std::string pop_message() { 
-    if (!has_messages()) 
-      throw std::logic_error("No messages"); 
-    return message_queue.pop(); 
+
+  // Stops reading and gives up the socket, returning a duplicate of its
+  // descriptor for the caller to pass on, or -1. Runs on the io thread.
+  int detach() {
+    boost::system::error_code ignored;
+    resume_timer.cancel(ignored);
+    if (!socket.is_open())
+      return -1;
+    int fd = ::dup(socket.native_handle());
+    socket.close(ignored);
+    return fd;
   }
 
 private:
   // Initializes the socket.
-  TcpConnection(boost::asio::io_service& io_service)
-    : socket(io_service) {}
+  TcpConnection(boost::asio::io_service& io_service, const RateLimitConfig& limits)
+    : Connection(io_service, limits), socket(io_service) {}
+
+  // Wait for and read the next message.
+  void start_read() {
+    socket.async_read_some(boost::asio::buffer(rcvbuf),
+        boost::bind(&TcpConnection::handle_read,
+          boost::static_pointer_cast<TcpConnection>(shared_from_this()),
+          boost::asio::placeholders::error,
+          boost::asio::placeholders::bytes_transferred));
+  }
   
   // Callback for when an asynchronous  read completes. 
   void handle_read(const boost::system::error_code& error, size_t bytes_transferred) {    
     if (!error) {
-      message_queue.push(rcvbuf);
+      if (!handle_input(rcvbuf, bytes_transferred))
+        return;
+    }
+    else if (error == boost::asio::error::operation_aborted) {
+      return;
     }
     else if (error != boost::asio::error::eof) {
       std::cerr << "FATAL handle_read error: " << error << "\n";
       return;
     }
 
-    // Wait for and read the next message.
-    socket.async_read_some(boost::asio::buffer(rcvbuf),
-        boost::bind(&TcpConnection::handle_read, shared_from_this(),
-          boost::asio::placeholders::error,
-          boost::asio::placeholders::bytes_transferred));
+    start_read();
+  }
+
+  // Writes the next chunk of join data.
+  void send_join_chunk() {
+    const char* data;
+    std::size_t size;
+    if (!next_join_chunk(data, size)) {
+      join_done();
+      return;
+    }
+
+    boost::asio::async_write(socket, boost::asio::buffer(data, size),
+        boost::bind(&TcpConnection::handle_join_write,
+          boost::static_pointer_cast<TcpConnection>(shared_from_this()),
+          size, boost::asio::placeholders::error));
+  }
+
+  // Callback for when a chunk of join data has been written.
+  void handle_join_write(std::size_t size, const boost::system::error_code& error) {
+    if (error) {
+      std::cerr << "[join] write failed: " << error << "\n";
+      kicked = true;
+      join_done();
+      return;
+    }
+    advance_join(size);
+    send_join_chunk();
   }
 
   tcp::socket socket;
   char rcvbuf[BUFSIZ];
-  ThreadSafeQueue<std::string> message_queue;
 };
 
 /**
- * Represents the single TCP server, managing many client connections.
+ * Represents a client on the same host talking over a pair of shared memory
+ * rings (see shm_transport.h). The Unix socket the peer handed its region
+ * over on stays open only to notice when the peer goes away.
+ */
+class ShmConnection : public Connection {
+public:
+  typedef boost::shared_ptr<ShmConnection> pointer;
+
+  // Create a shared pointer to this shared memory connection.
+  static pointer create(boost::asio::io_service& io_service,
+      const RateLimitConfig& limits = RateLimitConfig()) {
+    return pointer(new ShmConnection(io_service, limits));
+  }
+
+  // Returns the Unix socket the peer connects on.
+  local::stream_protocol::socket& get_socket() {
+    return socket;
+  }
+
+  // Receives the peer's region and eventfds. Blocks only briefly since the
+  // peer sends them right after connecting. Throws on a bad handshake.
+  void attach() {
+    int fds[3];
+    std::string payload;
+    int count = recv_fds(socket.native_handle(), fds, 3, payload);
+    if (count != 3) {
+      for (int i = 0; i < count; ++i)
+        ::close(fds[i]);
+      throw std::runtime_error("Bad shared memory handshake");
+    }
+
+    try {
+      region.reset(ShmRegion::attach(fds[0]));
+    } catch (...) {
+      for (int i = 0; i < count; ++i)
+        ::close(fds[i]);
+      throw;
+    }
+    ::close(fds[0]);
+    server_wake.assign(fds[1]);
+    client_wake_fd = fds[2];
+    client_wake.assign(fds[2]);
+
+    // Any read on the socket means the peer is gone.
+    socket.async_read_some(boost::asio::buffer(closed_buf),
+        boost::bind(&ShmConnection::handle_closed,
+          boost::static_pointer_cast<ShmConnection>(shared_from_this()),
+          boost::asio::placeholders::error));
+  }
+
+  // Sends a message to this client. Returns true if write was successful.
+  // Waits up to SHM_SEND_TIMEOUT if the peer's ring is full.
+  bool send(std::string message) {
+    if (!region || kicked || closed) {
+      return false;
+    }
+
+    bool wake;
+    auto deadline = std::chrono::steady_clock::now() + SHM_SEND_TIMEOUT;
+    while (!region->to_client().push(message.data(), message.size(), wake)) {
+      if (message.size() > ShmRing::max_message() ||
+          std::chrono::steady_clock::now() > deadline || closed) {
+        std::cerr << "[send] shared memory peer not reading.\n";
+        return false;
+      }
+      std::this_thread::yield();
+    }
+
+    if (wake)
+      shm_notify(client_wake_fd);
+    return true;
+  }
+
+  // Closes the Unix socket, so the peer sees EOF, and stops reading the
+  // ring.
+  void close() {
+    boost::system::error_code ignored;
+    closed = true;
+    socket.close(ignored);
+    server_wake.cancel(ignored);
+    resume_timer.cancel(ignored);
+    join_timer.cancel(ignored);
+  }
+
+private:
+  ShmConnection(boost::asio::io_service& io_service, const RateLimitConfig& limits)
+    : Connection(io_service, limits), socket(io_service),
+      server_wake(io_service), client_wake(io_service),
+      client_wake_fd(-1), closed(false), join_timer(io_service) {}
+
+  // Drains the ring, then waits for the peer to signal more. A peer that
+  // corrupts its ring is disconnected.
+  void start_read() {
+    std::string message;
+    try {
+      while (region->to_server().pop(message)) {
+        if (!handle_message(message))
+          return;
+      }
+    } catch (std::exception& e) {
+      std::cerr << "[read] " << e.what() << ", disconnecting.\n";
+      kicked = true;
+      close();
+      return;
+    }
+
+    server_wake.async_read_some(boost::asio::buffer(&wake_buf, sizeof(wake_buf)),
+        boost::bind(&ShmConnection::handle_wake,
+          boost::static_pointer_cast<ShmConnection>(shared_from_this()),
+          boost::asio::placeholders::error));
+  }
+
+  // Callback for when the peer signals new messages.
+  void handle_wake(const boost::system::error_code& error) {
+    if (error) {
+      if (error != boost::asio::error::operation_aborted)
+        std::cerr << "FATAL shared memory wake error: " << error << "\n";
+      return;
+    }
+    start_read();
+  }
+
+  // Pushes as much of the join data as fits in the ring, retrying shortly
+  // if it's full. The main thread doesn't send while joining, so the io
+  // thread is the ring's only producer until join_done().
+  void send_join_chunk() {
+    const char* data;
+    std::size_t size;
+    bool wake = false, woken = false, more;
+    while ((more = next_join_chunk(data, size)) && !closed) {
+      if (!region->to_client().push(data, size, wake))
+        break;
+      woken |= wake;
+      advance_join(size);
+    }
+    if (woken)
+      shm_notify(client_wake_fd);
+
+    if (!more || closed) {
+      join_done();
+      return;
+    }
+    join_timer.expires_from_now(JOIN_RETRY);
+    join_timer.async_wait(boost::bind(&ShmConnection::handle_join_retry,
+          boost::static_pointer_cast<ShmConnection>(shared_from_this()),
+          boost::asio::placeholders::error));
+  }
+
+  // Callback for when a shared memory joiner may have made room.
+  void handle_join_retry(const boost::system::error_code& error) {
+    if (error) {
+      join_done();
+      return;
+    }
+    send_join_chunk();
+  }
+
+  // Callback for when the peer's Unix socket closes.
+  void handle_closed(const boost::system::error_code& error) {
+    std::cerr << "Shared memory peer disconnected.\n";
+    closed = true;
+    server_wake.cancel();
+    resume_timer.cancel();
+    join_timer.cancel();
+  }
+
+  local::stream_protocol::socket socket;
+  std::unique_ptr<ShmRegion> region;
+  boost::asio::posix::stream_descriptor server_wake;
+  boost::asio::posix::stream_descriptor client_wake;
+  int client_wake_fd;
+  std::atomic<bool> closed;
+  uint64_t wake_buf;
+  char closed_buf[1];
+  boost::asio::steady_timer join_timer;
+};
+
+/**
+ * Represents one TCP server, managing many client connections. Several
+ * shard processes may share a port, in which case the kernel spreads new
+ * connections across them.
  */
 class TcpServer {
 public:
-  // Initializes this server with the given port.
-  TcpServer(unsigned int port) :
-    acceptor_(io_service, tcp::endpoint(tcp::v4(), port)), next_id(0) {
+  // Initializes this server with the given port and per-client inbound
+  // limits. With `shared_port` other processes may listen on the same port
+  // and the server runs as a shard: it keeps track of started and ended
+  // sessions for the shard to collect. Shared memory clients can't be
+  // handed between processes, so they're only taken when the port isn't
+  // shared.
+  TcpServer(unsigned int port, const RateLimitConfig& limits = RateLimitConfig(),
+      bool shared_port = false) :
+    acceptor_(io_service), local_acceptor(io_service), next_id(0),
+    bytes_per_tick(BYTES_PER_TICK), limits(limits), join_snapshot(nullptr),
+    sharded(shared_port) {
+    tcp::endpoint endpoint(tcp::v4(), port);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.set_option(tcp::acceptor::reuse_address(true));
+    if (shared_port)
+      acceptor_.set_option(reuse_port(true));
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+
+    // Channel 0 is the default channel used by send_to_all.
+    add_channel(ChannelConfig { 0, 1, 0 });
     start_accept();
+    if (!shared_port)
+      listen_local();
     
     // Run the io_service in a separate thread so it's non-blocking.
     std::thread(TcpServer::run, std::ref(io_service)).detach();
   }
   
-  // Sends a message to all clients.
-  void send_to_all(std::string message) {
+  // Adds an outbound channel for all clients and returns its id. Higher
+  // priority channels are sent first when a client is over budget.
+  int add_channel(const ChannelConfig& config) {
+    channels.push_back(config);
+    removed_channel_stats.push_back(ChannelStats());
+    for (auto const &c : client_list) {
+      c.second->get_scheduler().add_channel(config);
+    }
+    for (auto const &s : sessions) {
+      if (s.second->client_id == 0)
+        s.second->pending.add_channel(config);
+    }
+    return channels.size() - 1;
+  }
+
+  // Sets the number of bytes each client may be sent per tick. 0 is unlimited.
+  void set_bytes_per_tick(std::size_t bytes) {
+    bytes_per_tick = bytes;
+    for (auto const &c : client_list) {
+      c.second->get_scheduler().set_budget(bytes);
+    }
+  }
+
+  // Queues a message to all clients on the given channel, and to sessions
+  // waiting to be resumed so they don't miss it. Nothing is written until
+  // flush() is called.
+  void send_to_all(std::string message, int channel = 0) {
+    for (auto const &c : client_list) {
+      c.second->queue(channel, message);
+    }
+    for (auto const &s : sessions) {
+      if (s.second->client_id == 0)
+        s.second->pending.push(channel, message);
+    }
+  }
+
+  // Sends each client what its scheduler releases this tick. Clients whose
+  // writes fail are dropped. Given a job system, clients are flushed in
+  // parallel, since each one only touches its own scheduler and socket.
+  void flush(JobSystem* jobs = nullptr) {
+    // What's held for disconnected sessions ages like anything deferred.
+    for (auto const &s : sessions) {
+      if (s.second->client_id == 0)
+        s.second->pending.hold_tick();
+    }
+
     // No clients connected.
     if (client_list.size() == 0) {
       return;
     }
-    
+
     std::cerr << "[" << client_list.size() << "]\n";
-    for (auto const &c : client_list) {
-      std::cerr << "↗ (" << c.first << ") " << message;
-      bool success = c.second->send(message);
-      if (!success) {
-        std::cerr << "Write failed!\n";
-        client_list.erase(c.first);
+    std::vector<std::pair<int, Connection::pointer>> clients(
+        client_list.begin(), client_list.end());
+
+    std::vector<char> ok(clients.size());
+    auto flush_range = [&](std::size_t begin, std::size_t end) {
+      for (std::size_t i = begin; i < end; ++i) {
+        ok[i] = clients[i].second->flush();
+      }
+    };
+    if (jobs) {
+      jobs->parallel_for(0, clients.size(), FLUSH_GRAIN, flush_range);
+    } else {
+      flush_range(0, clients.size());
+    }
+
+    for (std::size_t i = 0; i < clients.size(); ++i) {
+      if (!ok[i]) {
+        std::cerr << "Write failed! (" << clients[i].first << ")\n";
+        drop_client(clients[i].first);
       }
     }
   }
-  
-  // Read all messages from all clients.
+
+  // Returns the given channel's counters summed over all clients, including
+  // ones that have since been removed.
+  ChannelStats get_channel_stats(int channel) {
+    ChannelStats total = removed_channel_stats.at(channel);
+    for (auto const &c : client_list) {
+      add_channel_stats(total, c.second->get_scheduler().get_stats(channel));
+    }
+    return total;
+  }
+
+  // Returns the inbound rate limiting counters summed over all clients,
+  // including ones that have since been removed.
+  RateLimitTotals get_limit_stats() {
+    RateLimitTotals total = removed_limit_stats;
+    for (auto const &c : client_list) {
+      add_limit_stats(total, c.second->get_limit_stats());
+    }
+    return total;
+  }
+
+  // Sets the snapshot streamed to clients as they join. May be null.
+  void set_join_snapshot(const JoinSnapshot* snapshot) {
+    join_snapshot = snapshot;
+  }
+
+  // Returns the tokens of sessions started since the last call. Always
+  // empty unless sharded.
+  std::vector<std::string> take_started_sessions() {
+    std::vector<std::string> tokens;
+    tokens.swap(started_sessions);
+    return tokens;
+  }
+
+  // Returns the tokens of sessions expired since the last call. Sessions
+  // handed off to another shard aren't included. Always empty unless
+  // sharded.
+  std::vector<std::string> take_ended_sessions() {
+    std::vector<std::string> tokens;
+    tokens.swap(ended_sessions);
+    return tokens;
+  }
+
+  // Hands a session's client over to another shard, passing its socket
+  // over `link` along with `line` followed by the session token and stream
+  // offset. The session is forgotten here; anything queued but not yet sent
+  // is dropped. Returns false, keeping the client, if it isn't connected
+  // over TCP or is still joining.
+  bool handoff(const std::string& token, ShardLink& link, const std::string& line) {
+    auto found = sessions.find(token);
+    if (found == sessions.end() || found->second->client_id == 0 || !link.is_connected())
+      return false;
+    std::shared_ptr<Session> session = found->second;
+    TcpConnection::pointer connection =
+      boost::dynamic_pointer_cast<TcpConnection>(client_list[session->client_id]);
+    if (!connection || connection->is_joining())
+      return false;
+
+    retire_stats(connection);
+    client_list.erase(session->client_id);
+    sessions.erase(found);
+    io_service.post(boost::bind(&TcpServer::send_handoff, connection, &link,
+          line + " " + token + " " + std::to_string(session->history.end()) + "\n"));
+    return true;
+  }
+
+  // Takes over a client handed off by another shard. Its stream carries on
+  // from `offset` with the join snapshot, so it must expect one.
+  void adopt(int fd, const std::string& token, uint64_t offset) {
+    TcpConnection::pointer connection = TcpConnection::create(io_service, limits);
+    boost::system::error_code error;
+    connection->get_socket().assign(tcp::v4(), fd, error);
+    if (error) {
+      std::cerr << "Can't adopt client: " << error.message() << "\n";
+      ::close(fd);
+      return;
+    }
+    connection->skip_greeting();
+
+    int id = ++next_id;
+    client_list[id] = connection;
+    auto session = std::make_shared<Session>();
+    session->token = token;
+    session->client_id = id;
+    session->history.skip(offset);
+    sessions[token] = session;
+    connection->set_session(session);
+    add_channels(connection);
+
+    std::vector<std::shared_ptr<const std::string>> parts;
+    if (join_snapshot && join_snapshot->get()) {
+      parts.push_back(join_snapshot->get());
+      session->history.skip(parts.back()->size());
+    }
+    io_service.post(boost::bind(&Connection::start, connection));
+    connection->start_join(parts);
+  }
+
+  // Sets how to find the shard owning a session this server doesn't know.
+  // A client asking to resume such a session is passed over the returned
+  // link, if any, instead of starting a new session.
+  void set_resume_router(boost::function<ShardLink* (const std::string&)> router) {
+    resume_router = router;
+  }
+
+  // Takes over a client that asked another shard to resume `token` at
+  // `offset`. It's added at the start of the next tick like any client.
+  void adopt_resume(int fd, const std::string& token, uint64_t offset) {
+    TcpConnection::pointer connection = TcpConnection::create(io_service, limits);
+    boost::system::error_code error;
+    connection->get_socket().assign(tcp::v4(), fd, error);
+    if (error) {
+      std::cerr << "Can't adopt client: " << error.message() << "\n";
+      ::close(fd);
+      return;
+    }
+    connection->skip_greeting(token, offset);
+    pending_clients.push(connection);
+    io_service.post(boost::bind(&Connection::start, connection));
+  }
+
+  // Read all messages from all clients. Clients accepted since the last
+  // call are added first.
   std::vector<std::string> read_all_messages() {
     std::vector<std::string> messages;
+    add_pending_clients();
     
     // No clients connected.
     if (client_list.size() == 0) {
@@ -155,7 +928,7 @@ private:
   // Begin accepting new clients.
   void start_accept() {
     TcpConnection::pointer new_connection =
-      TcpConnection::create(acceptor_.get_io_service());
+      TcpConnection::create(acceptor_.get_io_service(), limits);
 
     acceptor_.async_accept(new_connection->get_socket(),
         boost::bind(&TcpServer::handle_accept, this, new_connection,
@@ -167,14 +940,259 @@ private:
       const boost::system::error_code& error) {
     if (!error) {
       std::cerr << "Accepted new connection." << std::endl;
-      client_list[++next_id] = new_connection;
-      new_connection->start();
+      add_client(new_connection);
     }
 
     // Accept the next client.
     start_accept();
   }
 
+  // Begin listening for shared memory peers on SHM_SOCKET_PATH. The server
+  // still runs without them if the socket can't be created.
+  void listen_local() {
+    boost::system::error_code error;
+    ::unlink(SHM_SOCKET_PATH);
+    local_acceptor.open(local::stream_protocol(), error);
+    if (!error)
+      local_acceptor.bind(local::stream_protocol::endpoint(SHM_SOCKET_PATH), error);
+    if (!error)
+      local_acceptor.listen(boost::asio::socket_base::max_connections, error);
+    if (error) {
+      std::cerr << "Shared memory transport disabled: " << error.message() << "\n";
+      return;
+    }
+    start_local_accept();
+  }
+
+  // Begin accepting new shared memory peers.
+  void start_local_accept() {
+    ShmConnection::pointer new_connection = ShmConnection::create(io_service, limits);
+
+    local_acceptor.async_accept(new_connection->get_socket(),
+        boost::bind(&TcpServer::handle_local_accept, this, new_connection,
+          boost::asio::placeholders::error));
+  }
+
+  // Callback for when a shared memory peer connects. Waits for it to send
+  // its region before adding it.
+  void handle_local_accept(ShmConnection::pointer new_connection,
+      const boost::system::error_code& error) {
+    if (!error) {
+      new_connection->get_socket().async_read_some(boost::asio::null_buffers(),
+          boost::bind(&TcpServer::handle_local_handshake, this, new_connection,
+            boost::asio::placeholders::error));
+    }
+
+    start_local_accept();
+  }
+
+  // Callback for when a shared memory peer's region is ready to receive.
+  void handle_local_handshake(ShmConnection::pointer new_connection,
+      const boost::system::error_code& error) {
+    if (error)
+      return;
+
+    try {
+      new_connection->attach();
+    } catch (std::exception& e) {
+      std::cerr << "Rejected shared memory peer: " << e.what() << "\n";
+      return;
+    }
+    std::cerr << "Accepted new shared memory connection." << std::endl;
+    add_client(new_connection);
+  }
+
+  // Sets up a new client's channels and adds it to the client list.
+  // Starts reading from a new client. Once its greeting arrives it is
+  // handed to the main thread, which adds it at the start of the next tick.
+  void add_client(Connection::pointer new_connection) {
+    new_connection->on_greeting(boost::bind(&TcpServer::handle_greeting, this, _1));
+    new_connection->start();
+  }
+
+  // Callback for when a client's greeting arrives. Runs on the io thread.
+  void handle_greeting(Connection::pointer new_connection) {
+    pending_clients.push(new_connection);
+  }
+
+  // Adds clients greeted since the last tick to the client list. Clients
+  // resuming a live session are sent only what they missed; everyone else
+  // gets a new session and the join snapshot, which matches the world as of
+  // the end of last tick, so everything queued from this tick on follows on
+  // from it.
+  void add_pending_clients() {
+    expire_sessions();
+    while (!pending_clients.empty()) {
+      Connection::pointer new_connection = pending_clients.pop();
+      int id = ++next_id;
+      client_list[id] = new_connection;
+      if (!resume_session(id, new_connection) && !forward_resume(id, new_connection)) {
+        start_session(id, new_connection);
+      }
+    }
+  }
+
+  // Starts a new session for a client and streams it the join snapshot.
+  void start_session(int id, Connection::pointer new_connection) {
+    auto session = std::make_shared<Session>();
+    session->token = Session::make_token();
+    session->client_id = id;
+    sessions[session->token] = session;
+    if (sharded)
+      started_sessions.push_back(session->token);
+    new_connection->set_session(session);
+    add_channels(new_connection);
+
+    std::vector<std::shared_ptr<const std::string>> parts;
+    parts.push_back(std::make_shared<std::string>(
+          "SESSION " + session->token + " 0\n"));
+    if (join_snapshot && join_snapshot->get()) {
+      parts.push_back(join_snapshot->get());
+      session->history.skip(parts.back()->size());
+    }
+    new_connection->start_join(parts);
+  }
+
+  // Sets up a new client's budget and channels.
+  void add_channels(Connection::pointer new_connection) {
+    SendScheduler &scheduler = new_connection->get_scheduler();
+    scheduler.set_budget(bytes_per_tick);
+    for (auto const &config : channels) {
+      scheduler.add_channel(config);
+    }
+  }
+
+  // Moves a session over to a reconnecting client and replays what it
+  // missed. Returns false if there's no such session or the client is too
+  // far behind, in which case it needs a new session.
+  bool resume_session(int id, Connection::pointer new_connection) {
+    const std::string &token = new_connection->get_resume_token();
+    auto found = sessions.find(token);
+    if (token.empty() || found == sessions.end())
+      return false;
+
+    std::shared_ptr<Session> session = found->second;
+    uint64_t offset = new_connection->get_resume_offset();
+    auto replay = std::make_shared<std::string>();
+    if (!session->history.replay_from(offset, *replay)) {
+      std::cerr << "Session " << token << " too far behind to resume.\n";
+      return false;
+    }
+
+    // The old connection may not have noticed it's dead yet.
+    if (session->client_id != 0) {
+      drop_client(session->client_id);
+    }
+    std::cerr << "Resumed session " << token << " at " << offset
+      << ", replaying " << replay->size() << " bytes.\n";
+
+    session->client_id = id;
+    new_connection->set_session(session);
+    new_connection->get_scheduler() = std::move(session->pending);
+    new_connection->get_scheduler().set_budget(bytes_per_tick);
+
+    std::vector<std::shared_ptr<const std::string>> parts;
+    parts.push_back(std::make_shared<std::string>(
+          "SESSION " + token + " " + std::to_string(offset) + "\n"));
+    parts.push_back(replay);
+    new_connection->start_join(parts);
+    return true;
+  }
+
+  // Adds one client's rate limiting counters to `total`.
+  static void add_limit_stats(RateLimitTotals& total, const RateLimitStats& stats) {
+    total.accepted_messages += stats.accepted_messages;
+    total.accepted_bytes += stats.accepted_bytes;
+    total.dropped_messages += stats.dropped_messages;
+    total.dropped_bytes += stats.dropped_bytes;
+    total.pauses += stats.pauses;
+    total.disconnects += stats.disconnects;
+  }
+
+  // Adds one client's counters for a channel to `total`.
+  static void add_channel_stats(ChannelStats& total, const ChannelStats& stats) {
+    total.sent_messages += stats.sent_messages;
+    total.sent_bytes += stats.sent_bytes;
+    total.deferred += stats.deferred;
+    total.evicted += stats.evicted;
+  }
+
+  // Keeps a client's counters in the server totals once it's removed from
+  // the client list. Its channel counters are cleared, since its scheduler
+  // lives on in the session if it may resume.
+  void retire_stats(Connection::pointer connection) {
+    add_limit_stats(removed_limit_stats, connection->get_limit_stats());
+    SendScheduler &scheduler = connection->get_scheduler();
+    for (std::size_t i = 0; i < scheduler.channel_count(); ++i) {
+      add_channel_stats(removed_channel_stats[i], scheduler.get_stats(i));
+    }
+    scheduler.clear_stats();
+  }
+
+  // Passes a TCP client resuming a session this server doesn't know to the
+  // shard the router says owns it. Returns false if there's none.
+  bool forward_resume(int id, Connection::pointer new_connection) {
+    const std::string &token = new_connection->get_resume_token();
+    if (token.empty() || !resume_router || sessions.count(token))
+      return false;
+    ShardLink* link = resume_router(token);
+    TcpConnection::pointer connection =
+      boost::dynamic_pointer_cast<TcpConnection>(new_connection);
+    if (!link || !link->is_connected() || !connection)
+      return false;
+
+    std::cerr << "Forwarding resume of session " << token << " to shard "
+      << link->get_peer() << ".\n";
+    client_list.erase(id);
+    io_service.post(boost::bind(&TcpServer::send_handoff, connection, link,
+          "RESUME " + token + " " + std::to_string(new_connection->get_resume_offset()) + "\n"));
+    return true;
+  }
+
+  // Removes a client, keeping its session and anything still queued for it
+  // so it can resume.
+  void drop_client(int id) {
+    auto found = client_list.find(id);
+    if (found == client_list.end())
+      return;
+    retire_stats(found->second);
+    io_service.post(boost::bind(&Connection::close, found->second));
+
+    std::shared_ptr<Session> session = found->second->get_session();
+    if (session && session->client_id == id) {
+      session->client_id = 0;
+      session->disconnected_at = std::chrono::steady_clock::now();
+      session->pending = std::move(found->second->get_scheduler());
+    }
+    client_list.erase(found);
+  }
+
+  // Forgets sessions that have been disconnected for too long.
+  void expire_sessions() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = sessions.begin(); it != sessions.end(); ) {
+      const Session &session = *it->second;
+      if (session.client_id == 0 && now - session.disconnected_at > SESSION_TIMEOUT) {
+        if (sharded)
+          ended_sessions.push_back(session.token);
+        it = sessions.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // Passes a handed off client's socket to the other shard. Runs on the io
+  // thread so no read is in progress when the socket is given up.
+  static void send_handoff(TcpConnection::pointer connection, ShardLink* link,
+      const std::string& line) {
+    int fd = connection->detach();
+    if (fd < 0 || !link->send(line, fd))
+      std::cerr << "Handoff to shard " << link->get_peer() << " failed, client lost.\n";
+    if (fd >= 0)
+      ::close(fd);
+  }
+
   // Run the io_service. Is run on a separate thread to avoid blocking.
   static void run(boost::asio::io_service& io_service) {
     io_service.run();
@@ -182,14 +1200,293 @@ private:
   
   boost::asio::io_service io_service;
   tcp::acceptor acceptor_;
-  std::map<int, TcpConnection::pointer> client_list;
+  local::stream_protocol::acceptor local_acceptor;
+  std::map<int, Connection::pointer> client_list;
   int next_id;
+  std::vector<ChannelConfig> channels;
+  std::size_t bytes_per_tick;
+  RateLimitConfig limits;
+  RateLimitTotals removed_limit_stats;
+  std::vector<ChannelStats> removed_channel_stats;   // By channel.
+  ThreadSafeQueue<Connection::pointer> pending_clients;
+  const JoinSnapshot* join_snapshot;
+  std::map<std::string, std::shared_ptr<Session>> sessions;
+  boost::function<ShardLink* (const std::string&)> resume_router;
+  bool sharded;
+  std::vector<std::string> started_sessions;
+  std::vector<std::string> ended_sessions;
+};
+
+/**
+ * One shard's part of the world when it's split across processes: a
+ * vertical strip, linked to the shards either side. Entities that leave the
+ * strip are handed to the neighbour they're now in, players along with
+ * their connection, and entities near each edge are mirrored to the
+ * neighbour so its clients can see across the boundary.
+ *
+ * Shards also tell each other which of them owns each session, relayed
+ * along the line, so a client resuming on the wrong shard can be passed
+ * along to the right one. Main thread only.
+ */
+class ShardZone {
+public:
+  ShardZone(int shard, int shards) :
+    shard(shard),
+    min_x(WORLD_SIZE * shard / shards),
+    max_x(WORLD_SIZE * (shard + 1) / shards) {
+    if (shard > 0)
+      left.reset(new ShardLink(shard, shard - 1));
+    if (shard + 1 < shards)
+      right.reset(new ShardLink(shard, shard + 1));
+  }
+
+  float get_min_x() const { return min_x; }
+  float get_max_x() const { return max_x; }
+
+  // Gives each new session a player somewhere in the zone, and removes the
+  // players of sessions that have ended.
+  void update_players(TcpServer& server, EntityStore& world, std::minstd_rand& rng) {
+    std::uniform_real_distribution<float> x(min_x, max_x), y(0, WORLD_SIZE), v(-50, 50);
+    for (auto const &token : server.take_started_sessions()) {
+      add_player(token, world.create(x(rng), y(rng), v(rng), v(rng)));
+      announce("OWNER " + token + " " + std::to_string(shard) + "\n", nullptr);
+    }
+    for (auto const &token : server.take_ended_sessions()) {
+      announce("GONE " + token + "\n", nullptr);
+      auto found = players.find(token);
+      if (found != players.end()) {
+        world.destroy(found->second);
+        remove_player(token);
+      }
+    }
+  }
+
+  // Returns the link towards the shard owning a session this one doesn't
+  // have, or null if no other shard is known to own it.
+  ShardLink* route(const std::string& token) {
+    auto found = owners.find(token);
+    if (found == owners.end() || found->second == shard)
+      return nullptr;
+    return found->second < shard ? left.get() : right.get();
+  }
+
+  // Handles everything the neighbours sent since the last call.
+  void receive(TcpServer& server, EntityStore& world) {
+    receive(left.get(), left_mirrors, server, world);
+    receive(right.get(), right_mirrors, server, world);
+  }
+
+  // Hands entities that have left the zone to the neighbour they're now in.
+  // Any that can't be handed over yet stay put and are retried next tick.
+  void hand_off(TcpServer& server, EntityStore& world) {
+    const std::vector<float> &xs = world.get_pos_x();
+    std::vector<EntityHandle> leaving;
+    for (uint32_t i = 0; i < world.size(); ++i) {
+      if (xs[i] < min_x || xs[i] >= max_x)
+        leaving.push_back(world.handle_at(i));
+    }
+
+    for (auto handle : leaving) {
+      uint32_t i = world.dense_index(handle);
+      ShardLink* link = xs[i] < min_x ? left.get() : right.get();
+      if (!link)
+        continue;
+
+      std::string state = format_state(world, i);
+      auto player = player_tokens.find(handle.slot);
+      bool sent;
+      if (player != player_tokens.end()) {
+        std::string token = player->second;
+        sent = server.handoff(token, *link, "HANDOFF " + state);
+        if (sent) {
+          std::cerr << "Handed session " << token << " to shard " << link->get_peer() << ".\n";
+          remove_player(token);
+        }
+      } else {
+        sent = link->send("ENTITY " + state + "\n");
+      }
+      if (sent)
+        world.destroy(handle);
+    }
+  }
+
+  // Sends each neighbour the entities within MIRROR_MARGIN of its edge: a
+  // "MIRROR" line, replacing the last set, then the entities already in
+  // the "M <shard> <id> <x> <y>" form clients are sent.
+  void mirror(const EntityStore& world) {
+    const std::vector<float> &xs = world.get_pos_x();
+    std::vector<uint32_t> near_left, near_right;
+    for (uint32_t i = 0; i < world.size(); ++i) {
+      if (left && xs[i] < min_x + MIRROR_MARGIN)
+        near_left.push_back(i);
+      if (right && xs[i] >= max_x - MIRROR_MARGIN)
+        near_right.push_back(i);
+    }
+    if (left) {
+      std::string lines = "MIRROR\n";
+      world.write_mirrors(near_left, shard, lines);
+      left->send(lines);
+    }
+    if (right) {
+      std::string lines = "MIRROR\n";
+      world.write_mirrors(near_right, shard, lines);
+      right->send(lines);
+    }
+  }
+
+  // Appends the neighbours' latest mirrored entities to `out`, one
+  // "M <shard> <id> <x> <y>" line each.
+  void write_mirrors(std::string& out) const {
+    out += left_mirrors;
+    out += right_mirrors;
+  }
+
+private:
+  // Handles what one neighbour sent.
+  void receive(ShardLink* link, std::string& mirrors, TcpServer& server, EntityStore& world) {
+    if (!link)
+      return;
+
+    LinkMessage message;
+    while (link->poll(message)) {
+      // Mirrored entities are passed on to clients as they are.
+      if (message.line.compare(0, 2, "M ") == 0) {
+        mirrors += message.line;
+        mirrors += '\n';
+        continue;
+      }
+
+      std::istringstream line(message.line);
+      std::string command, token;
+      float x, y, vx, vy;
+      uint64_t offset;
+      int owner;
+      line >> command;
+      if (command == "MIRROR") {
+        mirrors.clear();
+      } else if (command == "ENTITY" && line >> x >> y >> vx >> vy) {
+        world.create(x, y, vx, vy);
+      } else if (command == "HANDOFF" && message.fd >= 0 &&
+          line >> x >> y >> vx >> vy >> token >> offset) {
+        std::cerr << "Took over session " << token << " from shard " << link->get_peer() << ".\n";
+        server.adopt(message.fd, token, offset);
+        message.fd = -1;
+        add_player(token, world.create(x, y, vx, vy));
+        announce("OWNER " + token + " " + std::to_string(shard) + "\n", nullptr);
+      } else if (command == "RESUME" && message.fd >= 0 && line >> token >> offset) {
+        // Carry on away from where it came from, or take it here.
+        ShardLink* next = route(token);
+        if (next && next != link && next->send(message.line + "\n", message.fd)) {
+          ::close(message.fd);
+        } else {
+          server.adopt_resume(message.fd, token, offset);
+        }
+        message.fd = -1;
+      } else if (command == "OWNER" && line >> token >> owner) {
+        owners[token] = owner;
+        announce(message.line + "\n", link);
+      } else if (command == "GONE" && line >> token) {
+        owners.erase(token);
+        announce(message.line + "\n", link);
+      } else {
+        std::cerr << "Bad message from shard " << link->get_peer() << ": " << message.line << "\n";
+      }
+
+      if (message.fd >= 0)
+        ::close(message.fd);
+    }
+  }
+
+  // Sends a line to both neighbours, except the one it came from.
+  void announce(const std::string& line, ShardLink* from) {
+    if (left && left.get() != from)
+      left->send(line);
+    if (right && right.get() != from)
+      right->send(line);
+  }
+
+  // Formats an entity's position and velocity as "<x> <y> <vx> <vy>".
+  static std::string format_state(const EntityStore& world, uint32_t i) {
+    char state[96];
+    std::snprintf(state, sizeof(state), "%.9g %.9g %.9g %.9g",
+        world.get_pos_x()[i], world.get_pos_y()[i],
+        world.get_vel_x()[i], world.get_vel_y()[i]);
+    return state;
+  }
+
+  void add_player(const std::string& token, EntityHandle handle) {
+    players[token] = handle;
+    player_tokens[handle.slot] = token;
+  }
+
+  void remove_player(const std::string& token) {
+    auto found = players.find(token);
+    if (found == players.end())
+      return;
+    player_tokens.erase(found->second.slot);
+    players.erase(found);
+  }
+
+  int shard;
+  float min_x;
+  float max_x;
+  std::unique_ptr<ShardLink> left;
+  std::unique_ptr<ShardLink> right;
+  std::string left_mirrors;
+  std::string right_mirrors;
+  std::map<std::string, EntityHandle> players;
+  std::map<uint32_t, std::string> player_tokens;    // By entity slot.
+  std::map<std::string, int> owners;    // Shard owning each session elsewhere.
 };
 
-int main() {
+// Usage: server [<shard> <shards>]. Run as one of several shards, each
+// process owns a strip of the world; they all listen on the same port.
+int main(int argc, char* argv[]) {
   try {
-    TcpServer server(PORT);
-    std::cerr << "Running server on port " << PORT << std::endl;
+    int shard = 0, shards = 1;
+    if (argc == 3) {
+      shard = std::atoi(argv[1]);
+      shards = std::atoi(argv[2]);
+    }
+    if ((argc != 1 && argc != 3) || shards < 1 || shard < 0 || shard >= shards) {
+      std::cerr << "Usage: server [<shard> <shards>]" << std::endl;
+      return 1;
+    }
+
+    // Shards on one host split its cores between them.
+    JobSystem jobs(JobSystem::default_workers() / shards);
+    TcpServer server(PORT, RateLimitConfig(), shards > 1);
+    std::unique_ptr<ShardZone> zone;
+    if (shards > 1) {
+      zone.reset(new ShardZone(shard, shards));
+      server.set_resume_router(boost::bind(&ShardZone::route, zone.get(), _1));
+    }
+    std::cerr << "Running server on port " << PORT << " with "
+      << jobs.size() << " job threads";
+    if (zone)
+      std::cerr << " as shard " << shard << " of " << shards;
+    std::cerr << std::endl;
+
+    // Entity state goes out ahead of anything on the default channel.
+    int state_channel = server.add_channel(ChannelConfig { 10, 1, 0 });
+
+    EntityStore world;
+    Bounds bounds { 0, 0, WORLD_SIZE, WORLD_SIZE };
+    std::minstd_rand rng(std::random_device{}());
+    std::uniform_real_distribution<float> x(zone ? zone->get_min_x() : 0,
+        zone ? zone->get_max_x() : WORLD_SIZE);
+    std::uniform_real_distribution<float> y(0, WORLD_SIZE);
+    std::uniform_real_distribution<float> velocity(-50, 50);
+    for (int i = 0; i < WORLD_ENTITIES / shards; ++i) {
+      world.create(x(rng), y(rng), velocity(rng), velocity(rng));
+    }
+
+    const float dt = std::chrono::duration<float>(TICK).count();
+    std::vector<uint32_t> dirty;
+
+    // New clients are sent the whole world, kept serialized as it changes.
+    JoinSnapshot snapshot;
+    server.set_join_snapshot(&snapshot);
     for (;;) {
       auto messages = server.read_all_messages();
       
@@ -200,11 +1497,36 @@ int main() {
         }
       }
       
-      // TODO update stuff
+      if (zone) {
+        zone->update_players(server, world, rng);
+        zone->receive(server, world);
+      }
+
+      // TODO game logic; for now entities just drift and bounce.
+      world.update(dt, bounds, &jobs);
+      if (zone)
+        zone->hand_off(server, world);
+
+      // Broadcast what changed this tick, and what's just across the
+      // boundary when sharded.
+      std::string state;
+      dirty.clear();
+      world.collect_dirty(dirty);
+      EntityStore::write_removed(world.collect_removed(), state);
+      world.write_entities(dirty, state);
+      if (zone) {
+        zone->mirror(world);
+        zone->write_mirrors(state);
+      }
+      if (!state.empty()) {
+        server.send_to_all(state, state_channel);
+      }
+      snapshot.update(world, dirty);
       
       server.send_to_all("Hello from server!\n");
+      server.flush(&jobs);
       
-      std::this_thread::sleep_for(std::chrono::milliseconds(300));
+      std::this_thread::sleep_for(TICK);
     }
   } catch (std::exception& e) {
     std::cerr << e.what() << std::endl;
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "send_scheduler.h"
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+
+// Bytes of recently sent stream kept per session for replay on resume.
+#define REPLAY_BYTES (256 * 1024)
+
+// How long a disconnected session can still be resumed.
+#define SESSION_TIMEOUT std::chrono::seconds(30)
+
+/**
+ * The tail of a session's outbound byte stream. Every byte sent to the
+ * client after the handshake line has an offset; a client that reconnects
+ * says how far it got, and if that's still in the window only the bytes
+ * after it need resending.
+ */
+class ReplayBuffer {
+public:
+  ReplayBuffer() : start(0) {}
+
+  // Records bytes sent to the client.
+  void append(const std::string& data) {
+    bytes += data;
+    trim();
+  }
+
+  // Advances the stream past bytes that are sent but not kept, such as
+  // join snapshots, which are cheaper to resend whole.
+  void skip(std::size_t count) {
+    start += bytes.size() + count;
+    bytes.clear();
+  }
+
+  // Offset of the next byte to be sent.
+  uint64_t end() const {
+    return start + bytes.size();
+  }
+
+  // Copies everything sent from `offset` on into `out`. Returns false if
+  // `offset` has fallen out of the window or is in the future.
+  bool replay_from(uint64_t offset, std::string& out) const {
+    if (offset < start || offset > end())
+      return false;
+    out.assign(bytes, offset - start, std::string::npos);
+    return true;
+  }
+
+private:
+  // Drops the oldest bytes once the buffer is twice the window, so the cost
+  // of trimming is spread over many appends.
+  void trim() {
+    if (bytes.size() <= 2 * REPLAY_BYTES)
+      return;
+    std::size_t excess = bytes.size() - REPLAY_BYTES;
+    bytes.erase(0, excess);
+    start += excess;
+  }
+
+  uint64_t start;       // Offset of bytes[0].
+  std::string bytes;
+};
+
+/**
+ * A client's session, which outlives any one connection. Owned by the main
+ * thread, except for `history`, which is only appended to by the flush of
+ * the session's current connection.
+ */
+struct Session {
+  std::string token;
+  ReplayBuffer history;
+  int client_id = 0;      // Entry in the server's client list, 0 if none.
+  std::chrono::steady_clock::time_point disconnected_at;
+
+  // What was still queued for the client when its connection dropped, plus
+  // everything broadcast since, handed to the next connection on resume.
+  SendScheduler pending;
+
+  // Returns a new random token, hex encoded.
+  static std::string make_token() {
+    static std::random_device device;
+    std::ostringstream token;
+    token << std::hex << std::setfill('0');
+    for (int i = 0; i < 4; ++i)
+      token << std::setw(8) << (uint32_t) device();
+    return token.str();
+  }
+};
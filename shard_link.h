@@ -0,0 +1,233 @@
+#pragma once
+
+#include "threadsafe_queue.h"
+#include "fd_passing.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+// Unix socket each shard listens on for its lower neighbour's link.
+#define SHARD_SOCKET_PREFIX "/tmp/net-sandbox-shard-"
+
+// How often a link retries connecting to a neighbour that isn't up yet.
+#define SHARD_RETRY std::chrono::milliseconds(100)
+
+/**
+ * One line received over a shard link, with the file descriptor that was
+ * passed along with it, if any.
+ */
+struct LinkMessage {
+  std::string line;
+  int fd;
+};
+
+/**
+ * Link between two neighbouring shard processes over a Unix domain socket.
+ * Messages are newline terminated lines; a line may carry a file
+ * descriptor, which is how a client's socket moves between shards.
+ *
+ * The higher numbered shard listens and the lower one connects, retrying
+ * until it's up and again whenever the link drops. A background thread
+ * does the connecting and reading and queues what arrives for the main
+ * thread to poll. send() may be called from any thread.
+ */
+class ShardLink {
+public:
+  // Links `shard` to `peer`, which must be shard - 1 or shard + 1.
+  ShardLink(int shard, int peer) :
+    shard(shard), peer(peer), listen_fd(-1), fd(-1), running(true) {
+    if (peer < shard)
+      listen_fd = listen_on(socket_path(shard));
+    thread = std::thread(&ShardLink::run, this);
+  }
+
+  ~ShardLink() {
+    running = false;
+    if (listen_fd >= 0)
+      shutdown(listen_fd, SHUT_RDWR);
+    {
+      std::lock_guard<std::mutex> lock(send_mutex);
+      if (fd >= 0)
+        shutdown(fd, SHUT_RDWR);
+    }
+    thread.join();
+    if (listen_fd >= 0)
+      close(listen_fd);
+  }
+
+  // Returns the neighbour's shard number.
+  int get_peer() const {
+    return peer;
+  }
+
+  // Returns true while the link is up.
+  bool is_connected() {
+    std::lock_guard<std::mutex> lock(send_mutex);
+    return fd >= 0;
+  }
+
+  // Sends one line, which must end in a newline, optionally passing a file
+  // descriptor along with it. The descriptor is duplicated by the kernel;
+  // the caller still owns it. Returns false if the link is down.
+  bool send(const std::string& line, int passed_fd = -1) {
+    std::lock_guard<std::mutex> lock(send_mutex);
+    if (fd < 0)
+      return false;
+
+    std::size_t offset = 0;
+    if (passed_fd >= 0) {
+      // The descriptor rides on the first bytes of the line.
+      std::size_t first = std::min<std::size_t>(line.size(), 1024);
+      if (!send_fds(fd, &passed_fd, 1, line.substr(0, first)))
+        return false;
+      offset = first;
+    }
+
+    while (offset < line.size()) {
+      ssize_t sent = ::send(fd, line.data() + offset, line.size() - offset, MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR)
+        continue;
+      if (sent <= 0)
+        return false;
+      offset += sent;
+    }
+    return true;
+  }
+
+  // Removes the next received line. Returns false if there are none.
+  bool poll(LinkMessage& message) {
+    if (received.empty())
+      return false;
+    message = received.pop();
+    return true;
+  }
+
+  static std::string socket_path(int shard) {
+    return SHARD_SOCKET_PREFIX + std::to_string(shard) + ".sock";
+  }
+
+private:
+  // Binds and listens on a Unix socket, replacing any stale one.
+  static int listen_on(const std::string& path) {
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = make_address(path);
+    unlink(path.c_str());
+    if (s < 0 || bind(s, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(s, 1) < 0)
+      throw std::runtime_error("Can't listen on " + path);
+    return s;
+  }
+
+  static struct sockaddr_un make_address(const std::string& path) {
+    struct sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+  }
+
+  // Waits for the neighbour to connect, or connects to it. Returns -1 once
+  // the link is shutting down.
+  int establish() {
+    while (running) {
+      if (listen_fd >= 0) {
+        int s = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (s >= 0)
+          return s;
+      } else {
+        int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un addr = make_address(socket_path(peer));
+        if (s >= 0 && connect(s, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+          return s;
+        if (s >= 0)
+          close(s);
+      }
+      std::this_thread::sleep_for(SHARD_RETRY);
+    }
+    return -1;
+  }
+
+  // Background thread: keeps the link up and queues what it receives.
+  void run() {
+    while (running) {
+      int s = establish();
+      if (s < 0)
+        return;
+      {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        fd = s;
+      }
+      std::cerr << "Linked to shard " << peer << ".\n";
+
+      read_loop(s);
+
+      std::cerr << "Lost link to shard " << peer << ".\n";
+      {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        fd = -1;
+      }
+      close(s);
+    }
+  }
+
+  // Reads until the link drops, splitting the stream into lines. A passed
+  // descriptor rides on the first bytes of its line, and the kernel never
+  // returns bytes sent after those in the same read, though it may return
+  // earlier lines ahead of them. So it belongs to the last line that starts
+  // in the read that delivers it.
+  void read_loop(int s) {
+    std::string buffer;
+    std::deque<int> fds;
+    std::deque<std::size_t> fd_offsets;   // Where its line starts in `buffer`.
+    while (running) {
+      int passed[MAX_PASSED_FDS];
+      std::string payload;
+      int count = recv_fds(s, passed, MAX_PASSED_FDS, payload);
+      if (count < 0)
+        break;
+      buffer += payload;
+      if (count > 0) {
+        std::size_t last = buffer.size() > 1 ? buffer.rfind('\n', buffer.size() - 2) : std::string::npos;
+        for (int i = 0; i < count; ++i) {
+          fds.push_back(passed[i]);
+          fd_offsets.push_back(last == std::string::npos ? 0 : last + 1);
+        }
+      }
+
+      std::size_t start = 0, newline;
+      while ((newline = buffer.find('\n', start)) != std::string::npos) {
+        LinkMessage message { buffer.substr(start, newline - start), -1 };
+        if (!fd_offsets.empty() && fd_offsets.front() <= newline) {
+          message.fd = fds.front();
+          fds.pop_front();
+          fd_offsets.pop_front();
+        }
+        received.push(message);
+        start = newline + 1;
+      }
+      buffer.erase(0, start);
+      for (auto &offset : fd_offsets)
+        offset -= start;
+    }
+    for (int passed_fd : fds)
+      close(passed_fd);
+  }
+
+  int shard;
+  int peer;
+  int listen_fd;
+  int fd;
+  std::atomic<bool> running;
+  std::mutex send_mutex;
+  ThreadSafeQueue<LinkMessage> received;
+  std::thread thread;
+};
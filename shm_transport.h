@@ -0,0 +1,204 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+// Unix socket the server listens on for shared memory peers.
+#define SHM_SOCKET_PATH "/tmp/net-sandbox.sock"
+
+// Bytes of message data in each direction. Must be a power of two.
+#define SHM_RING_CAPACITY (1 << 20)
+
+/**
+ * Head and tail of one ring, on separate cache lines so the producer and
+ * consumer don't false share. Both are free running byte counters.
+ */
+struct ShmRingHeader {
+  alignas(64) std::atomic<uint64_t> head;   // Advanced by the consumer.
+  alignas(64) std::atomic<uint64_t> tail;   // Advanced by the producer.
+};
+
+/**
+ * Lock-free single producer, single consumer ring of length prefixed
+ * messages, laid out in (possibly shared) memory. This is only a view; the
+ * memory is owned by ShmRegion.
+ */
+class ShmRing {
+public:
+  ShmRing() : header(nullptr), data(nullptr) {}
+
+  ShmRing(void* base) :
+    header(static_cast<ShmRingHeader*>(base)),
+    data(static_cast<char*>(base) + sizeof(ShmRingHeader)) {}
+
+  // Bytes a ring takes up in the region.
+  static std::size_t footprint() {
+    return sizeof(ShmRingHeader) + SHM_RING_CAPACITY;
+  }
+
+  // Largest message that can ever fit.
+  static std::size_t max_message() {
+    return SHM_RING_CAPACITY - sizeof(uint32_t);
+  }
+
+  // Appends a message. Returns false if there isn't room for it right now.
+  // Sets `wake` if the consumer may have gone to sleep on an empty ring and
+  // needs a wakeup.
+  bool push(const char* message, std::size_t size, bool& wake) {
+    wake = false;
+    if (size > max_message())
+      return false;
+
+    uint64_t tail = header->tail.load(std::memory_order_relaxed);
+    uint64_t head = header->head.load(std::memory_order_acquire);
+    std::size_t needed = sizeof(uint32_t) + size;
+    if (needed > SHM_RING_CAPACITY - (tail - head))
+      return false;
+
+    uint32_t length = size;
+    copy_in(tail, reinterpret_cast<const char*>(&length), sizeof(length));
+    copy_in(tail + sizeof(length), message, size);
+
+    // Publishing the tail and then reading the head, both sequentially
+    // consistent, pairs with pop(): either the consumer sees this message,
+    // or we see that it drained everything before it and may be asleep.
+    header->tail.store(tail + needed);
+    wake = header->head.load() == tail;
+    return true;
+  }
+
+  // Removes the oldest message into `message`. Returns false if empty.
+  // Throws if the producer has written a bad length.
+  bool pop(std::string& message) {
+    uint64_t head = header->head.load(std::memory_order_relaxed);
+    uint64_t tail = header->tail.load();
+    if (head == tail)
+      return false;
+
+    uint32_t length;
+    copy_out(head, reinterpret_cast<char*>(&length), sizeof(length));
+    if (length > max_message() || sizeof(length) + length > tail - head)
+      throw std::runtime_error("Corrupt shared memory ring");
+
+    message.resize(length);
+    copy_out(head + sizeof(length), &message[0], length);
+    header->head.store(head + sizeof(length) + length);
+    return true;
+  }
+
+  // Returns true if there's nothing to read.
+  bool empty() const {
+    return header->head.load() == header->tail.load();
+  }
+
+private:
+  // Copies into the ring at a free running offset, wrapping as needed.
+  void copy_in(uint64_t offset, const char* src, std::size_t size) {
+    std::size_t start = offset & (SHM_RING_CAPACITY - 1);
+    std::size_t first = std::min(size, (std::size_t) SHM_RING_CAPACITY - start);
+    std::memcpy(data + start, src, first);
+    std::memcpy(data, src + first, size - first);
+  }
+
+  // Copies out of the ring at a free running offset, wrapping as needed.
+  void copy_out(uint64_t offset, char* dst, std::size_t size) const {
+    std::size_t start = offset & (SHM_RING_CAPACITY - 1);
+    std::size_t first = std::min(size, (std::size_t) SHM_RING_CAPACITY - start);
+    std::memcpy(dst, data + start, first);
+    std::memcpy(dst + first, data, size - first);
+  }
+
+  ShmRingHeader* header;
+  char* data;
+};
+
+/**
+ * A memory mapped region holding one ring in each direction between a
+ * server and a single peer. The peer creates it with an anonymous memfd and
+ * hands the fd to the server over SHM_SOCKET_PATH, along with one eventfd
+ * per direction for wakeups. The memfd is sealed against resizing, so the
+ * peer can't shrink it under the server's mapping.
+ */
+class ShmRegion {
+public:
+  // Creates a fresh, zeroed region. Returns the memfd through `fd`.
+  static ShmRegion* create(int& fd) {
+    fd = memfd_create("net-sandbox", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+      throw std::runtime_error("memfd_create failed");
+    if (ftruncate(fd, size()) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+      close(fd);
+      throw std::runtime_error("Can't size shared memory region");
+    }
+
+    ShmRegion* region = attach(fd);
+    new (region->base) ShmRingHeader();
+    new (static_cast<char*>(region->base) + ShmRing::footprint()) ShmRingHeader();
+    return region;
+  }
+
+  // Maps a region created by a peer. Throws if the fd isn't one, or isn't
+  // sealed against resizing.
+  static ShmRegion* attach(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (std::size_t) st.st_size != size())
+      throw std::runtime_error("Not a shared memory region");
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW))
+      throw std::runtime_error("Shared memory region not sealed");
+
+    void* base = mmap(nullptr, size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+      throw std::runtime_error("mmap failed");
+    return new ShmRegion(base);
+  }
+
+  ~ShmRegion() {
+    munmap(base, size());
+  }
+
+  // Total size of the region.
+  static std::size_t size() {
+    return 2 * ShmRing::footprint();
+  }
+
+  // Ring carrying messages from the peer to the server.
+  ShmRing& to_server() {
+    return up;
+  }
+
+  // Ring carrying messages from the server to the peer.
+  ShmRing& to_client() {
+    return down;
+  }
+
+private:
+  ShmRegion(void* base) :
+    base(base),
+    up(base),
+    down(static_cast<char*>(base) + ShmRing::footprint()) {}
+
+  ShmRegion(const ShmRegion&) = delete;
+  ShmRegion& operator=(const ShmRegion&) = delete;
+
+  void* base;
+  ShmRing up;
+  ShmRing down;
+};
+
+// Wakes whoever is waiting on the given eventfd.
+inline void shm_notify(int eventfd) {
+  uint64_t one = 1;
+  ssize_t ignored = write(eventfd, &one, sizeof(one));
+  (void) ignored;
+}
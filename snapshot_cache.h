@@ -0,0 +1,153 @@
+#pragma once
+
+#include "entity_store.h"
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Bytes in the snapshot header, "S <count>\n" padded to a fixed width.
+#define SNAPSHOT_HEADER_SIZE 16
+
+// Ticks of dirty indices kept for bringing pooled buffers up to date. A
+// free buffer further behind than this is dropped from the pool.
+#define SNAPSHOT_HISTORY 8
+
+/**
+ * Pre-serialized full world state for clients that join mid-game, kept up
+ * to date as the world changes instead of being rebuilt per joiner.
+ *
+ * The blob is a fixed width header followed by one fixed width entity
+ * record per dense index (see EntityStore::write_record), so each tick only
+ * the records of dirty entities are rewritten. Joiners all share the same
+ * immutable bytes, so a buffer is only patched once no joiner holds it.
+ * Buffers come from a small pool: each tick the free buffer closest to up
+ * to date is patched with the dirty indices it missed. A new buffer, which
+ * costs a copy of the whole blob, is only made when every buffer is still
+ * being streamed, so during a burst of joins the pool grows to cover them
+ * and later ticks reuse it.
+ *
+ * Not thread safe; updated and read on the main thread. The blobs it hands
+ * out are immutable and may be read from any thread.
+ */
+class JoinSnapshot {
+public:
+  JoinSnapshot() : front(-1), version(0) {}
+
+  // Brings the snapshot up to date with `world`. `dirty` must be the dense
+  // indices collect_dirty() returned this tick.
+  void update(const EntityStore& world, const std::vector<uint32_t>& dirty) {
+    version++;
+    history.push_back(dirty);
+    if (history.size() > SNAPSHOT_HISTORY)
+      history.pop_front();
+    drop_stale();
+
+    int target = pick_free();
+    if (target < 0) {
+      // Every buffer is being streamed; start another from the newest.
+      Buffer buffer;
+      buffer.blob = front >= 0 ? std::make_shared<std::string>(*pool[front].blob)
+                               : std::make_shared<std::string>();
+      buffer.version = front >= 0 ? pool[front].version : 0;
+      pool.push_back(buffer);
+      target = pool.size() - 1;
+    } else {
+      // use_count() is a relaxed load. Pair it with the release of the last
+      // joiner's reference so its reads happen before our writes.
+      std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    Buffer &buffer = pool[target];
+    std::string &blob = *buffer.blob;
+    blob.resize(SNAPSHOT_HEADER_SIZE + world.size() * ENTITY_RECORD_SIZE);
+    write_header(world.size(), &blob[0]);
+    if (buffer.version == 0 || version - buffer.version > history.size()) {
+      patch_all(world, blob);
+    } else {
+      std::size_t first = history.size() - (version - buffer.version);
+      for (std::size_t i = first; i < history.size(); ++i)
+        patch(world, history[i], blob);
+    }
+    buffer.version = version;
+    front = target;
+  }
+
+  // Returns the current snapshot. Empty until the first update().
+  std::shared_ptr<const std::string> get() const {
+    if (front < 0)
+      return std::shared_ptr<const std::string>();
+    return pool[front].blob;
+  }
+
+  // Number of buffers in the pool.
+  std::size_t pool_size() const {
+    return pool.size();
+  }
+
+private:
+  struct Buffer {
+    std::shared_ptr<std::string> blob;
+    unsigned long version;    // Tick it was last brought up to date, 0 if never.
+  };
+
+  // Returns the free buffer needing the fewest patches, or -1 if every
+  // buffer is held by a joiner.
+  int pick_free() const {
+    int best = -1;
+    for (std::size_t i = 0; i < pool.size(); ++i) {
+      if (pool[i].blob.use_count() == 1 &&
+          (best < 0 || pool[i].version > pool[best].version))
+        best = i;
+    }
+    return best;
+  }
+
+  // Drops free buffers too far behind to patch from the history.
+  void drop_stale() {
+    std::vector<Buffer> kept;
+    int kept_front = -1;
+    for (std::size_t i = 0; i < pool.size(); ++i) {
+      bool stale = version - pool[i].version > history.size();
+      if ((int) i != front && stale && pool[i].blob.use_count() == 1)
+        continue;
+      if ((int) i == front)
+        kept_front = kept.size();
+      kept.push_back(pool[i]);
+    }
+    pool.swap(kept);
+    front = kept_front;
+  }
+
+  // Rewrites the records at the given dense indices. Indices past the end
+  // belong to entities that have since been removed and are skipped.
+  static void patch(const EntityStore& world, const std::vector<uint32_t>& indices, std::string& blob) {
+    char* records = &blob[SNAPSHOT_HEADER_SIZE];
+    for (auto i : indices) {
+      if (i < world.size())
+        world.write_record(i, records + (std::size_t) i * ENTITY_RECORD_SIZE);
+    }
+  }
+
+  // Rewrites every record.
+  static void patch_all(const EntityStore& world, std::string& blob) {
+    char* records = &blob[SNAPSHOT_HEADER_SIZE];
+    for (uint32_t i = 0; i < world.size(); ++i)
+      world.write_record(i, records + (std::size_t) i * ENTITY_RECORD_SIZE);
+  }
+
+  // Writes "S <count>" padded with spaces to SNAPSHOT_HEADER_SIZE.
+  static void write_header(std::size_t count, char* header) {
+    std::string line = "S " + std::to_string(count);
+    line.resize(SNAPSHOT_HEADER_SIZE - 1, ' ');
+    line += '\n';
+    line.copy(header, SNAPSHOT_HEADER_SIZE);
+  }
+
+  std::vector<Buffer> pool;
+  int front;                  // Index in `pool` of the current snapshot.
+  unsigned long version;      // Ticks so far.
+  std::deque<std::vector<uint32_t>> history;   // Dirty indices of recent ticks, oldest first.
+};
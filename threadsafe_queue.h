@@ -3,6 +3,8 @@
  * License: MIT
  */
 
+#pragma once
+
 #include <mutex>
 #include <queue>
 #include <list>